@@ -58,14 +58,19 @@ static void resolve_arp_user_cb(int fd, const void *_ctx, bool expired)
 
 void resolve_arp_user(const struct resolve_arp_user *ctx)
 {
-	if (ctx->ipaddr == public_host_ip) {
+	/* The switch may have a segment of its own, where we have no
+	 * address. Ask from 0.0.0.0 there, as an RFC 5227 probe.
+	 */
+	bool uplink = ctx->ifindex == ifindex;
+
+	if (uplink && ctx->ipaddr == public_host_ip) {
 		if (ctx->macaddr)
 			memcpy(ctx->macaddr, host_mac, sizeof(macaddr_t));
 		ctx->cb(true, ctx->ctx);
 		return;
 	}
 
-	if (!same_subnet(ctx->ipaddr, public_host_ip, real_subnet_mask)) {
+	if (uplink && !same_subnet(ctx->ipaddr, public_host_ip, real_subnet_mask)) {
 		ctx->cb(false, ctx->ctx);
 		return;
 	}
@@ -77,12 +82,12 @@ void resolve_arp_user(const struct resolve_arp_user *ctx)
 	struct sockaddr_ll addr_bind = {
 		.sll_family = AF_PACKET,
 		.sll_protocol = htons(ETH_P_ARP),
-		.sll_ifindex = ifindex,
+		.sll_ifindex = ctx->ifindex,
 		.sll_hatype = htons(ARPHRD_ETHER),
 		.sll_pkttype = PACKET_HOST,
 		.sll_halen = sizeof(macaddr_t),
 	};
-	memcpy(addr_bind.sll_addr, host_mac, sizeof(macaddr_t));
+	memcpy(addr_bind.sll_addr, ctx->if_mac, sizeof(macaddr_t));
 
 	if (bind(sock, (struct sockaddr *)&addr_bind, sizeof(addr_bind)))
 		crash_with_perror("bind");
@@ -92,7 +97,7 @@ void resolve_arp_user(const struct resolve_arp_user *ctx)
 	struct arppkt *arp_request = (void *)arp_request_buf;
 
 	memcpy(arp_request->eth.h_dest, BROADCAST_MAC, sizeof(macaddr_t));
-	memcpy(arp_request->eth.h_source, host_mac, sizeof(macaddr_t));
+	memcpy(arp_request->eth.h_source, ctx->if_mac, sizeof(macaddr_t));
 	arp_request->eth.h_proto = htons(ETH_P_ARP);
 
 	arp_request->arph.ar_hrd = htons(ARPHRD_ETHER);
@@ -101,8 +106,8 @@ void resolve_arp_user(const struct resolve_arp_user *ctx)
 	arp_request->arph.ar_pln = 4;
 	arp_request->arph.ar_op = htons(ARPOP_REQUEST);
 
-	memcpy(arp_request->arppl.ar_sha, host_mac, sizeof(macaddr_t));
-	arp_request->arppl.ar_sip = public_host_ip;
+	memcpy(arp_request->arppl.ar_sha, ctx->if_mac, sizeof(macaddr_t));
+	arp_request->arppl.ar_sip = uplink ? public_host_ip : 0;
 	memset(arp_request->arppl.ar_tha, 0, sizeof(macaddr_t));
 	arp_request->arppl.ar_tip = ctx->ipaddr;
 
@@ -0,0 +1,221 @@
+#include "features.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "ishoal.h"
+#include "pkt.h"
+
+/* source: lib/checksum.c
+ * This is the reference implementation. The vectorized ones below must
+ * return exactly what this returns, for any alignment and length.
+ */
+static unsigned int do_csum_scalar(const unsigned char *buff, int len)
+{
+	int odd;
+	unsigned int result = 0;
+
+	if (len <= 0)
+		goto out;
+	odd = 1 & (unsigned long) buff;
+	if (odd) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		result += (*buff << 8);
+#else
+		result = *buff;
+#endif
+		len--;
+		buff++;
+	}
+	if (len >= 2) {
+		if (2 & (unsigned long) buff) {
+			result += *(unsigned short *) buff;
+			len -= 2;
+			buff += 2;
+		}
+		if (len >= 4) {
+			const unsigned char *end = buff + ((unsigned)len & ~3);
+			unsigned int carry = 0;
+			do {
+				unsigned int w = *(unsigned int *) buff;
+				buff += 4;
+				result += carry;
+				result += w;
+				carry = (w > result);
+			} while (buff < end);
+			result += carry;
+			result = (result & 0xffff) + (result >> 16);
+		}
+		if (len & 2) {
+			result += *(unsigned short *) buff;
+			buff += 2;
+		}
+	}
+	if (len & 1)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		result += *buff;
+#else
+		result += (*buff << 8);
+#endif
+	result = from32to16(result);
+	if (odd)
+		result = ((result >> 8) & 0xff) | ((result & 0xff) << 8);
+out:
+	return result;
+}
+
+unsigned int (*do_csum)(const unsigned char *buff, int len) = do_csum_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The vector kernels sum the buffer as 32-bit words, starting right at buff
+ * whatever its alignment, into 64-bit lanes. The one's complement sum does
+ * not care about the order or the width words are added in, nor about the
+ * byte swap lib/checksum.c does for odd addresses, so folding that down
+ * gives the same 16 bits.
+ */
+static unsigned int csum_fold64(uint64_t sum, const unsigned char *buff, int len)
+{
+	while (len >= 4) {
+		uint32_t w;
+		memcpy(&w, buff, sizeof(w));
+		sum += w;
+		buff += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, buff, sizeof(w));
+		sum += w;
+		buff += 2;
+		len -= 2;
+	}
+	if (len)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		sum += *buff;
+#else
+		sum += (*buff << 8);
+#endif
+
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return from32to16(sum);
+}
+
+__attribute__ ((target("sse2")))
+static unsigned int do_csum_sse2(const unsigned char *buff, int len)
+{
+	uint64_t sum = 0;
+
+	if (len >= 16) {
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+
+		for (; len >= 16; len -= 16, buff += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)buff);
+			acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+			acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		}
+
+		uint64_t lanes[2];
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		sum = lanes[0] + lanes[1];
+	}
+
+	return csum_fold64(sum, buff, len);
+}
+
+__attribute__ ((target("avx2")))
+static unsigned int do_csum_avx2(const unsigned char *buff, int len)
+{
+	uint64_t sum = 0;
+
+	if (len >= 32) {
+		__m256i zero = _mm256_setzero_si256();
+		__m256i acc0 = zero, acc1 = zero;
+
+		for (; len >= 64; len -= 64, buff += 64) {
+			__m256i v0 = _mm256_loadu_si256((const __m256i *)buff);
+			__m256i v1 = _mm256_loadu_si256((const __m256i *)(buff + 32));
+			acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+			acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+			acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+			acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+		}
+		for (; len >= 32; len -= 32, buff += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)buff);
+			acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+			acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+		}
+
+		uint64_t lanes[4];
+		_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+		sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	return csum_fold64(sum, buff, len);
+}
+
+__attribute__ ((target("avx512f")))
+static unsigned int do_csum_avx512(const unsigned char *buff, int len)
+{
+	uint64_t sum = 0;
+
+	if (len >= 64) {
+		__m512i zero = _mm512_setzero_si512();
+		__m512i acc0 = zero, acc1 = zero;
+
+		for (; len >= 64; len -= 64, buff += 64) {
+			__m512i v = _mm512_loadu_si512((const void *)buff);
+			acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+			acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+		}
+
+		sum = _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+	}
+
+	return csum_fold64(sum, buff, len);
+}
+
+/* Cheap sanity check of the selected kernel against the reference before
+ * trusting it with packets: every length up to a couple of vector widths,
+ * at every alignment within a cache line.
+ */
+static bool csum_selftest(unsigned int (*fn)(const unsigned char *buff, int len))
+{
+	unsigned char buf[64 + 256];
+	uint32_t x = 0x12345678;
+
+	for (int i = 0; i < sizeof(buf); i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 24;
+	}
+	/* Also hit the end-around carry */
+	memset(buf + 128, 0xff, 64);
+
+	for (int align = 0; align < 64; align++)
+		for (int len = 0; len <= 256; len++)
+			if (fn(buf + align, len) != do_csum_scalar(buf + align, len))
+				return false;
+
+	return true;
+}
+
+__attribute__((constructor))
+static void csum_select(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f") && csum_selftest(do_csum_avx512))
+		do_csum = do_csum_avx512;
+	else if (__builtin_cpu_supports("avx2") && csum_selftest(do_csum_avx2))
+		do_csum = do_csum_avx2;
+	else if (__builtin_cpu_supports("sse2") && csum_selftest(do_csum_sse2))
+		do_csum = do_csum_sse2;
+}
+
+#endif
@@ -10,11 +10,13 @@
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "ishoal.h"
 
 macaddr_t host_mac;
+macaddr_t switch_side_mac;
 macaddr_t gateway_mac;
 
 ipaddr_t public_host_ip;
@@ -74,13 +76,14 @@ static void get_if_macaddr(char *iface, macaddr_t *addr)
 	close(sock);
 }
 
-static void get_if_gateway(char *iface, ipaddr_t *addr)
+static bool get_if_gateway(char *iface, ipaddr_t *addr)
 {
 	bool found = false;
 	char *buf = read_whole_file("/proc/net/route", NULL);
+	char *saveptr;
 
-	char *line = strtok(buf, "\n");
-	while ((line = strtok(NULL, "\n"))) {
+	char *line = strtok_r(buf, "\n", &saveptr);
+	while ((line = strtok_r(NULL, "\n", &saveptr))) {
 		char *line_iface = NULL;
 		ipaddr_t line_dest, line_gateway;
 		uint16_t line_flags;
@@ -106,17 +109,17 @@ static void get_if_gateway(char *iface, ipaddr_t *addr)
 
 	free(buf);
 
-	if (!found)
-		crash_with_errormsg("Unable to determine default gateway IP address");
+	return found;
 }
 
 static bool resolve_arp_kernel(char *iface, ipaddr_t ipaddr, macaddr_t *macaddr)
 {
 	bool found = false;
 	char *buf = read_whole_file("/proc/net/arp", NULL);
+	char *saveptr;
 
-	char *line = strtok(buf, "\n");
-	while ((line = strtok(NULL, "\n"))) {
+	char *line = strtok_r(buf, "\n", &saveptr);
+	while ((line = strtok_r(NULL, "\n", &saveptr))) {
 		char *line_ipaddr = NULL;
 		char *line_macaddr = NULL;
 		char *line_iface = NULL;
@@ -191,6 +194,8 @@ static bool resolve_arp_user_wrapped(char *iface, ipaddr_t ipaddr, macaddr_t *ma
 
 	ctx->rau.ipaddr = ipaddr;
 	ctx->rau.macaddr = macaddr;
+	ctx->rau.ifindex = ifindex;
+	ctx->rau.if_mac = host_mac;
 	ctx->rau.el = el;
 	ctx->rau.cb = rau_cb;
 	ctx->rau.ctx = ctx;
@@ -211,9 +216,11 @@ void ifinfo_init(void)
 	get_if_ipaddr(iface, &public_host_ip);
 	get_if_netmask(iface, &real_subnet_mask);
 	get_if_macaddr(iface, &host_mac);
+	get_if_macaddr(switch_iface, &switch_side_mac);
 
 	ipaddr_t gateway_ip = 0;
-	get_if_gateway(iface, &gateway_ip);
+	if (!get_if_gateway(iface, &gateway_ip))
+		crash_with_errormsg("Unable to determine default gateway IP address");
 
 	if (!resolve_arp_kernel(iface, gateway_ip, &gateway_mac) &&
 	    !resolve_arp_user_wrapped(iface, gateway_ip, &gateway_mac)) {
@@ -222,3 +229,46 @@ void ifinfo_init(void)
 		crash_with_printf("Unable to resolve ARP for %s", str);
 	}
 }
+
+/* DHCP or a failover may move the default gateway after startup. Only
+ * the kernel's neighbour table is consulted here; our own traffic to the
+ * relay keeps the entry for the gateway in use there.
+ */
+#define GATEWAY_REFRESH_S 10
+
+static void gateway_refresh_cb(int fd, void *ctx, bool expired)
+{
+	uint64_t expirations;
+	ipaddr_t gateway_ip;
+	macaddr_t mac;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		crash_with_perror("read(timerfd)");
+
+	if (!get_if_gateway(iface, &gateway_ip) ||
+	    !resolve_arp_kernel(iface, gateway_ip, &mac))
+		return;
+
+	bpf_set_gateway_mac(mac);
+}
+
+void gateway_refresh_start(void)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		crash_with_perror("timerfd_create");
+
+	struct itimerspec its = {
+		.it_interval = { .tv_sec = GATEWAY_REFRESH_S },
+		.it_value = { .tv_sec = GATEWAY_REFRESH_S },
+	};
+	if (timerfd_settime(fd, 0, &its, NULL))
+		crash_with_perror("timerfd_settime");
+
+	worker_install_event(&(struct event){
+		.fd = fd,
+		.eventfd_ack = false,
+		.handler_type = EVT_CALL_FN,
+		.handler_fn = gateway_refresh_cb,
+	});
+}
@@ -41,14 +41,19 @@ extern int exitcode;
 extern char *progname;
 extern char *iface;
 extern int ifindex;
+extern char *switch_iface;
+extern int switch_ifindex;
 
 extern long pagesize;
 
 struct xdpfilter_bpf;
+struct xdpfilter_bpf__rodata;
 
 extern struct xdpfilter_bpf *obj;
+extern struct xdpfilter_bpf__rodata *xdp_rodata;
 extern macaddr_t switch_mac;
 extern macaddr_t host_mac;
+extern macaddr_t switch_side_mac;
 extern macaddr_t gateway_mac;
 
 extern ipaddr_t switch_ip;
@@ -60,6 +65,21 @@ extern ipaddr_t relay_ip;
 
 extern int remotes_log_fd;
 
+enum xsk_mode {
+	XSK_MODE_AUTO,
+	XSK_MODE_COPY,
+	XSK_MODE_ZEROCOPY,
+};
+
+extern enum xsk_mode xsk_mode;
+
+extern int busy_poll_budget;
+extern int busy_poll_usecs;
+extern bool xsk_latency_stats;
+extern bool tc_broadcast;
+extern int conn_entries;
+extern int nat_entries;
+
 enum event_handler {
 	EVT_CALL_FN,
 	EVT_BREAK,
@@ -106,26 +126,48 @@ void hex_dump(const void *ptr, size_t length);
 
 void fork_tee(void);
 
+void log_init(void);
+__attribute__ ((format(printf, 1, 2)))
+void log_printf(const char *fmt, ...);
+
 #define IP_STR_BULEN 16
 void ip_str(const ipaddr_t addr, char *str);
 #define MAC_STR_BULEN 18
 void mac_str(const macaddr_t addr, char *str);
 
 void ifinfo_init(void);
+void gateway_refresh_start(void);
 void start_endpoint(void);
 
 void load_conf(void);
 void save_conf(void);
 
-void bpf_set_switch_ip(const ipaddr_t addr);
-void bpf_set_switch_mac(const macaddr_t addr);
+void bpf_set_switch(const ipaddr_t addr, const macaddr_t mac);
+bool bpf_detect_switch(const ipaddr_t addr, const macaddr_t mac);
 void bpf_set_fake_gateway_ip(const ipaddr_t addr);
+void bpf_set_gateway_mac(const macaddr_t mac);
+
+/* A packet handed to userspace, and the buffer around it that it may be
+ * grown into (NULLs if there is none).
+ */
+struct pkt_buf {
+	void *data;
+	void *data_end;
+	void *data_hard_start;
+	void *data_hard_end;
+};
 
 struct xsk_socket *xsk_configure_socket(const char *iface, int queue,
-	void (*handler)(void *pkt, size_t length));
+	void (*handler)(struct pkt_buf *bufs, unsigned int n));
+bool xsk_tx(const void *pkt, size_t length);
 
 void tx(const void *pkt, size_t length);
-void xdpemu(void *pkt, size_t length);
+void tx_uplink(const void *pkt, size_t length);
+void xdpemu_batch(struct pkt_buf *bufs, unsigned int n);
+void xdpemu_stats_read(struct xdp_stat_entry stats[XDP_STAT_MAX]);
+void xdpemu_conn_stats_read(uint32_t slot, struct conn_stats *stats);
+
+extern unsigned int (*do_csum)(const unsigned char *buff, int len);
 
 struct thread;
 extern __thread struct thread *current;
@@ -135,6 +177,7 @@ void thread_stop(struct thread *thread);
 bool thread_should_stop(const struct thread *thread);
 int thread_stop_eventfd(const struct thread *thread);
 bool thread_is_main(const struct thread *thread);
+int thread_set_cpu(const struct thread *thread, int cpu);
 int thread_signal(const struct thread *thread, int sig);
 void thread_join(struct thread *thread);
 void thread_release(struct thread *thread);
@@ -190,6 +233,11 @@ void inotifyeventfd_rm(int fd);
 struct resolve_arp_user {
 	ipaddr_t ipaddr;
 	macaddr_t *macaddr;
+	/* Where to ask: the uplink, or switch_ifindex for collision probes
+	 * of addresses on the switch's segment.
+	 */
+	int ifindex;
+	const uint8_t *if_mac;
 	struct eventloop *el;
 	void (*cb)(bool solved, void *ctx);
 	void *ctx;
@@ -206,9 +254,26 @@ void delete_connection(ipaddr_t local_ip);
 void update_connection_remote_port(ipaddr_t local_ip, uint16_t new_port);
 
 void broadcast_all_remotes(const void *buf, size_t len);
+void remotes_fanout_stats(uint64_t *sent, uint64_t *failed);
 
-void bpf_add_connection(const struct connection *conn);
+int bpf_add_connection(const struct connection *conn);
 void bpf_delete_connection(ipaddr_t local_ip, uint16_t local_port);
+struct connection *bpf_lookup_connection_by_ip(ipaddr_t local_ip, uint32_t *slot);
+struct connection *bpf_lookup_connection_by_port(uint16_t local_port, uint32_t *slot);
+struct connection *bpf_lookup_connection_by_slot(uint32_t slot);
+int bpf_connection_stats(ipaddr_t local_ip, struct conn_stats *stats);
+void bpf_connection_stats_foreach(
+	void (*fn)(const struct connection *conn,
+		   const struct conn_stats *stats, void *ctx),
+	void *ctx);
+void bpf_connection_capacity(unsigned int *used, unsigned int *max,
+			     uint64_t *refused);
+
+void dp_event_handle(const struct dp_event *event);
+void dp_event_counts_read(uint64_t counts[DP_EVENT_MAX]);
+
+const char *xdp_stat_name(enum xdp_stat stat);
+void xdp_stats_read(struct xdp_stat_entry stats[XDP_STAT_MAX]);
 
 extern __thread bool thread_is_python;
 
@@ -1,11 +1,13 @@
 #include "features.h"
 
 #include <errno.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/eventfd.h>
 #include <unistd.h>
 #include <urcu.h>
@@ -17,9 +19,22 @@ int exitcode;
 char *progname;
 char *iface;
 int ifindex;
+/* Where the switch is plugged in, iface unless -s */
+char *switch_iface;
+int switch_ifindex;
 
 long pagesize;
 
+enum xsk_mode xsk_mode = XSK_MODE_AUTO;
+
+int busy_poll_budget;
+int busy_poll_usecs = 20;
+bool xsk_latency_stats;
+bool tc_broadcast;
+/* Zero picks a size, see size_maps() */
+int conn_entries;
+int nat_entries;
+
 struct thread *tui_thread;
 struct thread *bpf_load_thread;
 struct thread *python_thread;
@@ -34,23 +49,83 @@ static void sig_handler(int sig_num)
 	errno = save_errno;
 }
 
+__attribute__ ((noreturn))
+static void usage(char *argv0)
+{
+	crash_with_printf("Usage: %s [-x auto|copy|zerocopy] "
+			  "[-b budget[,usecs]] [-L] [-B] [-C max_peers] "
+			  "[-N nat_entries] [-s switch_interface] [interface]",
+			  argv0);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2)
-		crash_with_printf("Usage: %s [interface]", argv[0]);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "x:b:LBC:N:s:")) != -1) {
+		switch (opt) {
+		case 'x':
+			if (!strcmp(optarg, "auto"))
+				xsk_mode = XSK_MODE_AUTO;
+			else if (!strcmp(optarg, "copy"))
+				xsk_mode = XSK_MODE_COPY;
+			else if (!strcmp(optarg, "zerocopy"))
+				xsk_mode = XSK_MODE_ZEROCOPY;
+			else
+				usage(argv[0]);
+			break;
+		case 'b':
+			if (sscanf(optarg, "%d,%d", &busy_poll_budget,
+				   &busy_poll_usecs) < 1 ||
+			    busy_poll_budget <= 0 || busy_poll_usecs <= 0)
+				usage(argv[0]);
+			break;
+		case 'L':
+			xsk_latency_stats = true;
+			break;
+		case 'B':
+			tc_broadcast = true;
+			break;
+		case 'C':
+			if (sscanf(optarg, "%d", &conn_entries) < 1 ||
+			    conn_entries <= 0 || conn_entries > MAX_CONNS)
+				usage(argv[0]);
+			break;
+		case 'N':
+			if (sscanf(optarg, "%d", &nat_entries) < 1 ||
+			    nat_entries <= 0 || nat_entries > MAX_NAT_ENTRIES)
+				usage(argv[0]);
+			break;
+		case 's':
+			switch_iface = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 1)
+		usage(argv[0]);
 
 	progname = argv[0];
-	iface = argv[1];
+	iface = argv[optind];
 	ifindex = if_nametoindex(iface);
 	if (!ifindex)
 		crash_with_perror(iface);
 
+	if (!switch_iface)
+		switch_iface = iface;
+	switch_ifindex = if_nametoindex(switch_iface);
+	if (!switch_ifindex)
+		crash_with_perror(switch_iface);
+
 	if (geteuid())
 		crash_with_errormsg("You must be root");
 
 	pagesize = sysconf(_SC_PAGESIZE);
 
 	crashhandler_init();
+	log_init();
 
 	rcu_init();
 	rcu_register_thread();
@@ -6,13 +6,20 @@
 #include <linux/if_ether.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <urcu.h>
 
 struct xdpemu_env {
 	void *data;
 	void *data_end;
-	bool using_scratch;
+	/* Bounds the packet may grow into. These are the real headroom and
+	 * tailroom of the AF_XDP frame when there is one, so encapsulation
+	 * happens in place. Otherwise the packet is moved into scratch on
+	 * the first size change.
+	 */
+	void *data_hard_start;
+	void *data_hard_end;
 	char scratch[2048];
 };
 
@@ -33,7 +40,8 @@ static void copy_to_scratch(struct xdpemu_env *env)
 	env->data = env->scratch + HEADROOM;
 	env->data_end = env->scratch + HEADROOM + len;
 
-	env->using_scratch = true;
+	env->data_hard_start = env->scratch;
+	env->data_hard_end = env->scratch + sizeof(env->scratch);
 }
 #undef HEADROOM
 
@@ -41,13 +49,12 @@ static int bpf_xdp_adjust_head(struct xdpemu_env *xdp_md, int delta)
 {
 	struct xdpemu_env *env = (void *)xdp_md;
 
-	if (!env->using_scratch)
+	if (!env->data_hard_start)
 		copy_to_scratch(env);
 
-	void *data_start = env->scratch;
 	void *data = env->data + delta;
 
-	if (caa_unlikely(data < data_start ||
+	if (caa_unlikely(data < env->data_hard_start ||
 		     data > env->data_end - ETH_HLEN))
 		return -EINVAL;
 
@@ -63,13 +70,12 @@ static int bpf_xdp_adjust_tail(struct xdpemu_env *xdp_md, int delta)
 {
 	struct xdpemu_env *env = (void *)xdp_md;
 
-	if (!env->using_scratch)
+	if (!env->data_hard_start)
 		copy_to_scratch(env);
 
-	void *data_hard_end = env->scratch + sizeof(env->scratch);
 	void *data_end = env->data_end + delta;
 
-	if (caa_unlikely(data_end > data_hard_end))
+	if (caa_unlikely(data_end > env->data_hard_end))
 		return -EINVAL;
 
 	if (caa_unlikely(data_end < env->data + ETH_HLEN))
@@ -85,21 +91,87 @@ static int bpf_xdp_adjust_tail(struct xdpemu_env *xdp_md, int delta)
 
 #include "pkt.impl.h"
 
-void xdpemu(void *pkt, size_t length)
+void xdpemu_batch(struct pkt_buf *bufs, unsigned int n)
 {
-	struct xdpemu_env env = {
-		.data = pkt,
-		.data_end = pkt + length,
-	};
-	int res = xdp_prog(&env);
-
-	switch (res) {
-	case XDP_DROP:
-		break;
-	case XDP_TX:
-		tx(env.data, env.data_end - env.data);
-		break;
-	default:
-		assert(false);
+	if (caa_unlikely(!xdpemu_stats)) {
+		unsigned int i = uatomic_add_return(&xdpemu_stats_len, 1) - 1;
+
+		assert(i < MAX_XSKS);
+		xdpemu_stats = &xdpemu_stats_all[i];
+
+		struct conn_stats *conns = calloc(conn_entries, sizeof(*conns));
+		if (!conns)
+			crash_with_perror("calloc");
+		rcu_assign_pointer(xdpemu_stats->conns, conns);
+	}
+
+	rcu_read_lock();
+	xdpemu_bss = obj->bss;
+	xdpemu_rodata = rcu_dereference(xdp_rodata);
+	xdpemu_clock_sample();
+
+	for (unsigned int i = 0; i < n; i++) {
+		struct xdpemu_env env = {
+			.data = bufs[i].data,
+			.data_end = bufs[i].data_end,
+			.data_hard_start = bufs[i].data_hard_start,
+			.data_hard_end = bufs[i].data_hard_end,
+		};
+		int res = xdp_prog(&env);
+
+		switch (res) {
+		case XDP_DROP:
+			break;
+		case XDP_TX:
+			/* Queued on the AF_XDP TX ring, which the caller
+			 * submits once for the whole batch.
+			 */
+			tx(env.data, env.data_end - env.data);
+			break;
+		case XDP_REDIRECT:
+			/* Only ever to the uplink, see pkt_tx_port() */
+			tx_uplink(env.data, env.data_end - env.data);
+			break;
+		default:
+			assert(false);
+		}
+	}
+
+	map_cache_flush();
+	rcu_read_unlock();
+}
+
+void xdpemu_stats_read(struct xdp_stat_entry stats[XDP_STAT_MAX])
+{
+	unsigned int len = caa_min(uatomic_read(&xdpemu_stats_len), MAX_XSKS);
+
+	for (unsigned int i = 0; i < len; i++) {
+		for (int stat = 0; stat < XDP_STAT_MAX; stat++) {
+			struct xdp_stat_entry *entry = &xdpemu_stats_all[i].stats[stat];
+
+			stats[stat].packets += CMM_LOAD_SHARED(entry->packets);
+			stats[stat].bytes += CMM_LOAD_SHARED(entry->bytes);
+		}
+	}
+}
+
+void xdpemu_conn_stats_read(uint32_t slot, struct conn_stats *stats)
+{
+	unsigned int len = caa_min(uatomic_read(&xdpemu_stats_len), MAX_XSKS);
+
+	for (unsigned int i = 0; i < len; i++) {
+		struct conn_stats *conns = rcu_dereference(xdpemu_stats_all[i].conns);
+		if (!conns)
+			continue;
+
+		struct conn_stats *entry = &conns[slot];
+
+		stats->tx_packets += CMM_LOAD_SHARED(entry->tx_packets);
+		stats->tx_bytes += CMM_LOAD_SHARED(entry->tx_bytes);
+		stats->rx_packets += CMM_LOAD_SHARED(entry->rx_packets);
+		stats->rx_bytes += CMM_LOAD_SHARED(entry->rx_bytes);
+		stats->drops += CMM_LOAD_SHARED(entry->drops);
+		stats->last_seen_ns = caa_max(stats->last_seen_ns,
+					      CMM_LOAD_SHARED(entry->last_seen_ns));
 	}
 }
@@ -21,24 +21,49 @@ struct iph_pseudo {
 	uint16_t	l4_len;
 } __attribute__((packed)) __attribute__((aligned(4)));
 
-struct track_entry {
+/* A NAPT flow as it is addressed on the wire: outbound, from the host
+ * behind the fake gateway; inbound, from the remote to public_host_ip.
+ * ICMP echoes use their identifier as the port of the pinging side, and
+ * 0 for the other.
+ */
+struct napt_key {
 	ipaddr_t saddr;
-	macaddr_t h_source;
-	uint64_t ktime_ns;
-} __attribute__((packed));
-
-struct conntrack_key {
-	uint8_t  protocol;
+	ipaddr_t daddr;
 	uint16_t sport;
-} __attribute__((packed));
+	uint16_t dport;
+	uint8_t  protocol;
+	uint8_t  pad[3];
+};
 
-#define ICMP_ECHOTRACK_SIZE 64
+/* Where to send a packet leaving through the gateway */
+struct fib_nexthop {
+	macaddr_t h_dest;
+	macaddr_t h_source;
+	uint32_t ifindex;
+	uint64_t ktime_ns;
+};
 
-struct icmp_echotrack_key {
-	size_t length;
-	char data[ICMP_ECHOTRACK_SIZE];
+/* What xdp_prog parsed, for the route it hands the packet to */
+struct pkt_state {
+	struct dp_config cfg;
+	struct iph_pseudo iphp_orig;
+	uint32_t slot;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint16_t old_csum;
+	uint8_t icmp_type;
 };
 
+/* The other side of the translation: outbound, the public address and
+ * port; inbound, the host behind the fake gateway.
+ */
+struct napt_entry {
+	ipaddr_t addr;
+	uint16_t port;
+	macaddr_t h_source;
+	uint64_t ktime_ns;
+} __attribute__((packed));
+
 /* from include/net/ip.h */
 #define IP_CE		0x8000		/* Flag: "Congestion"		*/
 #define IP_DF		0x4000		/* Flag: "Don't Fragment"	*/
@@ -26,16 +26,44 @@ typedef struct xdp_md context_t;
 
 #define ACCESS_ONCE(x)	(*(__volatile__  __typeof__(x) *)&(x))
 #define barrier() __asm__ __volatile__ ("" : : : "memory")
+#define smp_rmb() barrier()
 
 #define BSS(variable) variable
+#define RODATA(variable) variable
 
 #define FUNCTION_ATTR SEC("xdp")
 
+/* Routes are programs of their own, tail called through xdp_routes. The
+ * whole chain runs on one CPU without being preempted, so a per-CPU slot
+ * carries what xdp_prog parsed over to them.
+ */
+#define PKT_STATE(st) \
+	uint32_t st##_key = 0; \
+	struct pkt_state *st = bpf_map_lookup_elem(&pkt_state_map, &st##_key); \
+	if (!st) \
+		return VERDICT(XDP_STAT_PASS, XDP_PASS)
+
+/* Only returns if userspace left the route empty */
+#define ROUTE_TO(route) ({ \
+	bpf_tail_call(ctx, &xdp_routes, route); \
+	VERDICT(XDP_STAT_PASS_NO_ROUTE, XDP_PASS); \
+})
+
 static int redirect_to_userspace(context_t *ctx)
 {
 	// source: tools/lib/bpf/xsk.c
 	int ret, index = ctx->rx_queue_index;
 
+	if (rx_timestamp &&
+	    !bpf_xdp_adjust_meta(ctx, -(int)sizeof(struct xsk_rx_meta))) {
+		struct xsk_rx_meta *meta = (void *)(long)ctx->data_meta;
+
+		if ((void *)(meta + 1) <= DATA(ctx)) {
+			meta->magic = XSK_RX_META_MAGIC;
+			meta->ktime_ns = bpf_ktime_get_ns();
+		}
+	}
+
 	// A set entry here means that the correspnding queue_id
 	// has an active AF_XDP socket bound to it.
 	ret = bpf_redirect_map(&xsks_map, index, XDP_PASS);
@@ -64,6 +92,57 @@ static int redirect_to_userspace(context_t *ctx)
 
 #define pkt_map_update_lookup(map, key, value)
 
+static __always_inline struct connection *pkt_conn_by_ip(ipaddr_t ip,
+							 uint32_t *slot)
+{
+	uint32_t *index = bpf_map_lookup_elem(&conn_by_ip, &ip);
+	if (!index)
+		return NULL;
+
+	if (slot)
+		*slot = *index;
+	return bpf_map_lookup_elem(&conns, index);
+}
+
+static __always_inline struct connection *pkt_conn_by_slot(uint32_t slot)
+{
+	return bpf_map_lookup_elem(&conns, &slot);
+}
+
+static __always_inline struct connection *pkt_conn_by_port(uint16_t port,
+							   uint32_t *slot)
+{
+	uint32_t *index = bpf_map_lookup_elem(&conn_by_port, &port);
+	if (!index)
+		return NULL;
+
+	if (slot)
+		*slot = *index;
+	return bpf_map_lookup_elem(&conns, index);
+}
+
+static __always_inline struct conn_stats *pkt_conn_stats(uint32_t slot)
+{
+	return bpf_map_lookup_elem(&conn_stats_map, &slot);
+}
+
+static __always_inline void pkt_count(context_t *ctx, enum xdp_stat stat)
+{
+	uint32_t key = stat;
+	struct xdp_stat_entry *entry = bpf_map_lookup_elem(&stats_map, &key);
+
+	if (entry) {
+		entry->packets++;
+		entry->bytes += DATA_END(ctx) - DATA(ctx);
+	}
+}
+
+/* Best effort, a full ring loses the event */
+static __always_inline void pkt_emit_event(const struct dp_event *event)
+{
+	bpf_ringbuf_output(&events, (void *)event, sizeof(*event), 0);
+}
+
 #else
 
 #include <arpa/inet.h>
@@ -101,80 +180,161 @@ static __always_inline uint16_t bpf_ntohs(uint16_t netshort)
 #define DECLARE_MAP_LOOKUP_VAR(type, name) typeof(type) name
 #define MAP_LOOKUP_DEREF(name) name
 
+/* The tracking maps are looked up and refreshed for every packet of a
+ * flow. Within a batch, each key is fetched with bpf() once and the
+ * updates are written back once by xdpemu_batch() at the end.
+ */
+#define MAP_CACHE_SIZE 16
+
+struct map_cache_entry {
+	int fd;
+	uint32_t key_size;
+	bool present;
+	bool dirty;
+	char key[sizeof(struct napt_key)];
+	struct napt_entry value;
+};
+
+static __thread struct map_cache_entry map_cache[MAP_CACHE_SIZE];
+static __thread unsigned int map_cache_len;
+
+static struct map_cache_entry *map_cache_get(int fd, const void *key,
+					     uint32_t key_size,
+					     uint32_t value_size)
+{
+	struct map_cache_entry *entry;
+
+	for (unsigned int i = 0; i < map_cache_len; i++) {
+		entry = &map_cache[i];
+		if (entry->fd == fd && entry->key_size == key_size &&
+		    !memcmp(entry->key, key, key_size))
+			return entry;
+	}
+
+	if (map_cache_len == MAP_CACHE_SIZE ||
+	    key_size > sizeof(entry->key) ||
+	    value_size > sizeof(entry->value))
+		return NULL;
+
+	entry = &map_cache[map_cache_len++];
+	entry->fd = fd;
+	entry->key_size = key_size;
+	entry->present = !bpf_map_lookup_elem(fd, key, &entry->value);
+	entry->dirty = false;
+	memcpy(entry->key, key, key_size);
+
+	return entry;
+}
+
+static int map_cache_lookup(int fd, const void *key, uint32_t key_size,
+			    void *value, uint32_t value_size)
+{
+	struct map_cache_entry *entry = map_cache_get(fd, key, key_size,
+						      value_size);
+	if (!entry)
+		return bpf_map_lookup_elem(fd, key, value);
+
+	if (!entry->present)
+		return -ENOENT;
+
+	memcpy(value, &entry->value, value_size);
+	return 0;
+}
+
+static int map_cache_update(int fd, const void *key, uint32_t key_size,
+			    const void *value, uint32_t value_size, uint64_t flags)
+{
+	struct map_cache_entry *entry = map_cache_get(fd, key, key_size,
+						      value_size);
+	if (!entry)
+		return bpf_map_update_elem(fd, key, value, flags);
+
+	if (flags != BPF_ANY) {
+		/* Let the kernel decide whether the flags allow it */
+		if (entry->dirty)
+			bpf_map_update_elem(fd, key, &entry->value, BPF_ANY);
+		entry->dirty = false;
+
+		int ret = bpf_map_update_elem(fd, key, value, flags);
+		entry->present = !bpf_map_lookup_elem(fd, key, &entry->value);
+		return ret;
+	}
+
+	memcpy(&entry->value, value, value_size);
+	entry->present = true;
+	entry->dirty = true;
+	return 0;
+}
+
+static int map_cache_delete(int fd, const void *key, uint32_t key_size)
+{
+	struct map_cache_entry *entry = map_cache_get(fd, key, key_size, 0);
+	if (entry) {
+		entry->present = false;
+		entry->dirty = false;
+	}
+
+	return bpf_map_delete_elem(fd, key);
+}
+
+static void map_cache_flush(void)
+{
+	for (unsigned int i = 0; i < map_cache_len; i++) {
+		struct map_cache_entry *entry = &map_cache[i];
+
+		if (entry->dirty)
+			bpf_map_update_elem(entry->fd, entry->key,
+					    &entry->value, BPF_ANY);
+	}
+
+	map_cache_len = 0;
+}
+
 #define pkt_map_update_elem(map, key, value, flags) \
-	bpf_map_update_elem(bpf_map__fd(obj->maps.map), key, value, flags)
+	map_cache_update(bpf_map__fd(obj->maps.map), key, sizeof(*(key)), \
+			 value, sizeof(*(value)), flags)
 
 #define pkt_map_lookup_elem(map, key, value) \
-	bpf_map_lookup_elem(bpf_map__fd(obj->maps.map), key, &value)
+	map_cache_lookup(bpf_map__fd(obj->maps.map), key, sizeof(*(key)), \
+			 &value, sizeof(value))
 
 #define pkt_map_delete_elem(map, key) \
-	bpf_map_delete_elem(bpf_map__fd(obj->maps.map), key)
+	map_cache_delete(bpf_map__fd(obj->maps.map), key, sizeof(*(key)))
 
 #define pkt_map_update_lookup(map, key, value) \
 	pkt_map_update_elem(map, key, &MAP_LOOKUP_DEREF(value), BPF_ANY)
 
-static uint64_t bpf_ktime_get_ns(void)
+/* Points straight into the mmap()ed conns array */
+#define pkt_conn_by_ip bpf_lookup_connection_by_ip
+#define pkt_conn_by_port bpf_lookup_connection_by_port
+#define pkt_conn_by_slot bpf_lookup_connection_by_slot
+
+/* Sampled once per batch by xdpemu_batch() from the coarse clock, which
+ * is the same clock the XDP program stamps with, minus up to a tick.
+ * Tracking entries expire after minutes, so that is plenty.
+ */
+static __thread uint64_t xdpemu_ktime_ns;
+
+static void xdpemu_clock_sample(void)
 {
 	struct timespec now;
-	if (clock_gettime(CLOCK_MONOTONIC, &now))
-		crash_with_perror("clock_gettime");
+	if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &now))
+		xdpemu_ktime_ns = (uint64_t) now.tv_sec * SECOND_NS + now.tv_nsec;
+}
 
-	return (uint64_t) now.tv_sec * SECOND_NS + now.tv_nsec;
+static uint64_t bpf_ktime_get_ns(void)
+{
+	return xdpemu_ktime_ns;
 }
 
-/* source: lib/checksum.c */
-static unsigned int do_csum(const unsigned char *buff, int len)
+static uint32_t bpf_get_prandom_u32(void)
 {
-	int odd;
-	unsigned int result = 0;
+	static __thread unsigned int seed;
 
-	if (len <= 0)
-		goto out;
-	odd = 1 & (unsigned long) buff;
-	if (odd) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-		result += (*buff << 8);
-#else
-		result = *buff;
-#endif
-		len--;
-		buff++;
-	}
-	if (len >= 2) {
-		if (2 & (unsigned long) buff) {
-			result += *(unsigned short *) buff;
-			len -= 2;
-			buff += 2;
-		}
-		if (len >= 4) {
-			const unsigned char *end = buff + ((unsigned)len & ~3);
-			unsigned int carry = 0;
-			do {
-				unsigned int w = *(unsigned int *) buff;
-				buff += 4;
-				result += carry;
-				result += w;
-				carry = (w > result);
-			} while (buff < end);
-			result += carry;
-			result = (result & 0xffff) + (result >> 16);
-		}
-		if (len & 2) {
-			result += *(unsigned short *) buff;
-			buff += 2;
-		}
-	}
-	if (len & 1)
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-		result += *buff;
-#else
-		result += (*buff << 8);
-#endif
-	result = from32to16(result);
-	if (odd)
-		result = ((result >> 8) & 0xff) | ((result & 0xff) << 8);
-out:
-	return result;
+	if (!seed)
+		seed = xdpemu_ktime_ns ^ (uintptr_t)&seed;
+
+	return rand_r(&seed);
 }
 
 static uint32_t csum_partial(const void *buff, int len, uint32_t wsum)
@@ -209,11 +369,55 @@ static uint32_t bpf_csum_diff(uint32_t *from, uint32_t from_size,
 
 #define ACCESS_ONCE(x)	CMM_ACCESS_ONCE(x)
 #define barrier() cmm_barrier()
+#define smp_rmb() cmm_smp_rmb()
+
+/* One set of counters per emulating thread, claimed on its first batch.
+ * Only the owner writes to them. conns has conn_entries slots and is
+ * published once allocated, then never freed.
+ */
+struct xdpemu_stats {
+	struct xdp_stat_entry stats[XDP_STAT_MAX];
+	struct conn_stats *conns;
+} __attribute__((aligned(64)));
+
+static struct xdpemu_stats xdpemu_stats_all[MAX_XSKS];
+static unsigned int xdpemu_stats_len;
+static __thread struct xdpemu_stats *xdpemu_stats;
+
+static struct conn_stats *pkt_conn_stats(uint32_t slot)
+{
+	return &xdpemu_stats->conns[slot];
+}
+
+static void pkt_count(context_t *ctx, enum xdp_stat stat)
+{
+	struct xdp_stat_entry *entry = &xdpemu_stats->stats[stat];
+
+	CMM_STORE_SHARED(entry->packets, entry->packets + 1);
+	CMM_STORE_SHARED(entry->bytes,
+			 entry->bytes + (DATA_END(ctx) - DATA(ctx)));
+}
 
-#define BSS(variable) obj->bss->variable
+/* Already in userspace, so no ring to go through */
+#define pkt_emit_event dp_event_handle
+
+/* Set once per batch by xdpemu_batch(). xdpemu_rodata is that of the
+ * xdp_prog currently attached, and only valid within the batch.
+ */
+static __thread struct xdpfilter_bpf__bss *xdpemu_bss;
+static __thread const struct xdpfilter_bpf__rodata *xdpemu_rodata;
+
+#define BSS(variable) xdpemu_bss->variable
+#define RODATA(variable) xdpemu_rodata->variable
 
 #define FUNCTION_ATTR static
 
+/* Routes are plain calls through xdpemu_routes */
+static __thread struct pkt_state xdpemu_pkt_state;
+
+#define PKT_STATE(st) struct pkt_state *st = &xdpemu_pkt_state
+#define ROUTE_TO(route) xdpemu_routes[route](ctx)
+
 #endif
 
 #include "xdpfilter.h"
@@ -326,6 +530,251 @@ static uint16_t recompute_l4_csum_fast(context_t *ctx, struct iphdr *iph,
 	return onec_add(*csum_field, ~old_csum);
 }
 
+/* Set the source or destination port of the TCP or UDP header after iph,
+ * or the identifier of an ICMP echo, patching its checksum incrementally
+ * (RFC 1624). Only the first 8 bytes have to be in the packet, as in what
+ * an ICMP error quotes. Returns the change to the checksum field, like
+ * recompute_l4_csum_fast().
+ */
+static __always_inline uint16_t l4_set_port(context_t *ctx, struct iphdr *iph,
+					    bool dest, uint16_t port)
+{
+	void *l4 = (void *)(iph + 1);
+	uint16_t *port_field, *csum_field;
+
+	if (l4 + sizeof(struct icmphdr) > DATA_END(ctx))
+		return 0;
+
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *tcph = l4;
+		port_field = dest ? &tcph->dest : &tcph->source;
+		csum_field = &tcph->check;
+	} else if (iph->protocol == IPPROTO_UDP) {
+		struct udphdr *udph = l4;
+		port_field = dest ? &udph->dest : &udph->source;
+		csum_field = &udph->check;
+	} else if (iph->protocol == IPPROTO_ICMP) {
+		struct icmphdr *icmph = l4;
+		port_field = &icmph->un.echo.id;
+		csum_field = &icmph->checksum;
+	} else
+		return 0;
+
+	uint16_t old_port = *port_field;
+	*port_field = port;
+
+	if ((void *)(csum_field + 1) > DATA_END(ctx))
+		return 0;
+
+	uint16_t old_csum = *csum_field;
+
+	// if ipv4
+	if (iph->protocol == IPPROTO_UDP && !old_csum)
+		return 0;
+
+	*csum_field = ~onec_add(onec_add(~old_csum, ~old_port), port);
+	if (!*csum_field)
+		*csum_field = 0xffff;
+
+	return onec_add(*csum_field, ~old_csum);
+}
+
+/* Copy out the current config. Publications are far apart, so if one
+ * raced with the copy, the half it switched to is stable for a retry.
+ */
+static __always_inline void config_read(struct dp_config *cfg)
+{
+	for (int i = 0; i < 2; i++) {
+		uint32_t gen = ACCESS_ONCE(BSS(config_gen));
+		smp_rmb();
+
+		*cfg = BSS(config)[gen & 1];
+		smp_rmb();
+
+		if (ACCESS_ONCE(BSS(config_gen)) == gen)
+			break;
+	}
+}
+
+/* Count the packet under stat, then evaluate to action */
+#define VERDICT(stat, action) ({ pkt_count(ctx, stat); (action); })
+
+static __always_inline void pkt_count_conn(context_t *ctx, uint32_t slot,
+					   enum xdp_stat stat)
+{
+	struct conn_stats *stats = pkt_conn_stats(slot);
+	if (!stats)
+		return;
+
+	uint64_t len = DATA_END(ctx) - DATA(ctx);
+
+	switch (stat) {
+	case XDP_STAT_VPN_ENCAP:
+		stats->tx_packets++;
+		stats->tx_bytes += len;
+		break;
+	case XDP_STAT_VPN_DECAP:
+		stats->rx_packets++;
+		stats->rx_bytes += len;
+		stats->last_seen_ns = bpf_ktime_get_ns();
+		break;
+	default:
+		stats->drops++;
+	}
+}
+
+/* Same as VERDICT(), also counting against the peer in slot */
+#define CONN_VERDICT(slot, stat, action) \
+	({ pkt_count_conn(ctx, slot, stat); VERDICT(stat, action); })
+
+/* Signed, as the XDP program may have stamped the entry after the
+ * emulator sampled its clock.
+ */
+static __always_inline bool track_expired(uint64_t ktime_ns, uint64_t timeout)
+{
+	return (int64_t)(bpf_ktime_get_ns() - ktime_ns) > (int64_t)timeout;
+}
+
+#ifdef __BPF__
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+
+static __always_inline void fib_fallback(uint32_t ifindex,
+					 const struct dp_config *cfg,
+					 struct fib_nexthop *nh)
+{
+	memcpy(nh->h_dest, cfg->gateway_mac, sizeof(macaddr_t));
+	memcpy(nh->h_source, cfg->host_mac, sizeof(macaddr_t));
+	nh->ifindex = ifindex;
+}
+
+/* Next hop towards daddr as the kernel would route it from
+ * public_host_ip, cached per CPU for FIB_CACHE_NS. Falls back to the
+ * gateway userspace last resolved when the kernel has no answer, and
+ * goes straight there if forwarding could not be enabled on the uplink.
+ */
+static __always_inline void fib_nexthop(void *ctx, uint32_t ifindex,
+					const struct dp_config *cfg,
+					ipaddr_t daddr, struct fib_nexthop *nh)
+{
+	if (!RODATA(fib_enabled)) {
+		fib_fallback(ifindex, cfg, nh);
+		return;
+	}
+
+	struct fib_nexthop *cached = bpf_map_lookup_elem(&fib_cache, &daddr);
+	if (cached && !track_expired(cached->ktime_ns, FIB_CACHE_NS)) {
+		*nh = *cached;
+		return;
+	}
+
+	struct bpf_fib_lookup fib = {
+		.family = AF_INET,
+		.ipv4_src = RODATA(public_host_ip),
+		.ipv4_dst = daddr,
+		.ifindex = ifindex,
+	};
+
+	if (bpf_fib_lookup(ctx, &fib, sizeof(fib), BPF_FIB_LOOKUP_OUTPUT) ==
+	    BPF_FIB_LKUP_RET_SUCCESS) {
+		memcpy(nh->h_dest, fib.dmac, sizeof(macaddr_t));
+		memcpy(nh->h_source, fib.smac, sizeof(macaddr_t));
+		nh->ifindex = fib.ifindex;
+	} else {
+		fib_fallback(ifindex, cfg, nh);
+	}
+
+	nh->ktime_ns = bpf_ktime_get_ns();
+	bpf_map_update_elem(&fib_cache, &daddr, nh, BPF_ANY);
+}
+#endif
+
+/* The emulator has no FIB to ask */
+static __always_inline void pkt_nexthop(context_t *ctx,
+					const struct dp_config *cfg,
+					ipaddr_t daddr, struct fib_nexthop *nh)
+{
+#ifdef __BPF__
+	fib_nexthop(ctx, RODATA(uplink_ifindex), cfg, daddr, nh);
+#else
+	memcpy(nh->h_dest, cfg->gateway_mac, sizeof(macaddr_t));
+	memcpy(nh->h_source, cfg->host_mac, sizeof(macaddr_t));
+	nh->ifindex = RODATA(uplink_ifindex);
+#endif
+}
+
+/* The switch-facing interface and the uplink may be one and the same.
+ * Between two, packets cross over through tx_ports. The emulator only
+ * gets packets from the switch side; it returns XDP_REDIRECT for the
+ * uplink, which xdpemu_batch() hands to tx_uplink().
+ */
+static __always_inline bool pkt_from_switch_side(context_t *ctx)
+{
+#ifdef __BPF__
+	return ctx->ingress_ifindex == RODATA(switch_ifindex);
+#else
+	return true;
+#endif
+}
+
+static __always_inline int pkt_tx_port(context_t *ctx, enum tx_port port)
+{
+#ifdef __BPF__
+	uint32_t ifindex = port == TX_PORT_SWITCH ?
+		RODATA(switch_ifindex) : RODATA(uplink_ifindex);
+
+	if (ifindex != ctx->ingress_ifindex)
+		return bpf_redirect_map(&tx_ports, port, 0);
+#else
+	if (port == TX_PORT_UPLINK &&
+	    RODATA(uplink_ifindex) != RODATA(switch_ifindex))
+		return XDP_REDIRECT;
+#endif
+	return XDP_TX;
+}
+
+static __always_inline int pkt_tx_nexthop(context_t *ctx,
+					  const struct fib_nexthop *nh)
+{
+	if (nh->ifindex == RODATA(uplink_ifindex))
+		return pkt_tx_port(ctx, TX_PORT_UPLINK);
+#ifdef __BPF__
+	if (nh->ifindex != ctx->ingress_ifindex)
+		return bpf_redirect(nh->ifindex, 0);
+#endif
+	return XDP_TX;
+}
+
+#define NAPT_PORT_MIN 49152
+#define NAPT_PORT_TRIES 8
+
+/* Claim a public port for the inbound flow in_key, keeping the inside
+ * host's own port unless another host already has it towards the same
+ * remote. Ports of VPN connections are never handed out, as those would
+ * be taken for VPN traffic on the way back. Returns the port in network
+ * order, or 0 if every try collided.
+ */
+static __always_inline uint16_t napt_claim_port(struct napt_key *in_key,
+						struct napt_entry *in_entry)
+{
+	uint16_t port = in_entry->port;
+
+	for (int i = 0; i < NAPT_PORT_TRIES; i++) {
+		if (port && !pkt_conn_by_port(bpf_ntohs(port), NULL)) {
+			in_key->dport = port;
+			if (!pkt_map_update_elem(nat_in_map, in_key, in_entry,
+						 BPF_NOEXIST))
+				return port;
+		}
+
+		port = bpf_htons(NAPT_PORT_MIN + bpf_get_prandom_u32() %
+				 (65536 - NAPT_PORT_MIN));
+	}
+
+	return 0;
+}
+
 static __always_inline bool mac_eq(macaddr_t a, macaddr_t b)
 {
 #ifdef __BPF__
@@ -340,24 +789,39 @@ static __always_inline bool mac_eq(macaddr_t a, macaddr_t b)
 #endif
 }
 
-static __always_inline void memcpy_dyn(void *dst, void *src, void *end, size_t len)
+static __always_inline void emit_nat_event(enum dp_event_type type,
+					   const struct napt_key *out_key,
+					   uint16_t nat_port)
 {
-#ifdef __BPF__
-	char *dst_c = dst;
-	char *src_c = src;
-	char *end_c = end;
-
-	#pragma unroll
-	for (size_t i = 0; i < len; i++)
-		if (src_c + 2 < end_c)
-			*(dst_c++) = *(src_c++);
-#else
-	memcpy(dst, src, caa_min(len, end - src));
-#endif
+	struct dp_event event = {
+		.type = type,
+		.nat = {
+			.saddr = out_key->saddr,
+			.daddr = out_key->daddr,
+			.sport = out_key->sport,
+			.dport = out_key->dport,
+			.nat_port = nat_port,
+			.protocol = out_key->protocol,
+		},
+	};
+	pkt_emit_event(&event);
+}
+
+static __always_inline void emit_ttl_exceeded(const struct iphdr *iph)
+{
+	struct dp_event event = {
+		.type = DP_EVENT_TTL_EXCEEDED,
+		.ttl = {
+			.saddr = iph->saddr,
+			.daddr = iph->daddr,
+		},
+	};
+	pkt_emit_event(&event);
 }
 
 // source: samples/bpf/xdp_adjust_tail_kern.c
-static __always_inline int send_icmp4_timeout_exceeded(context_t *xdp)
+static __always_inline int send_icmp4_timeout_exceeded(context_t *xdp,
+						       const unsigned char *h_source)
 {
 	void *data, *data_end;
 
@@ -417,23 +881,151 @@ static __always_inline int send_icmp4_timeout_exceeded(context_t *xdp)
 	iph->ttl = 64;
 	iph->protocol = IPPROTO_ICMP;
 	iph->daddr = icmp_pl->iph.saddr;
-	iph->saddr = BSS(public_host_ip);
+	iph->saddr = RODATA(public_host_ip);
 	recompute_iph_csum(iph);
 
 	memcpy(eth->h_dest, eth_orig.h_source, sizeof(macaddr_t));
-	memcpy(eth->h_source, BSS(host_mac), sizeof(macaddr_t));
+	memcpy(eth->h_source, h_source, sizeof(macaddr_t));
 	eth->h_proto = bpf_htons(ETH_P_IP);
 
 	return XDP_TX;
 }
 
+/* The routes are separate stages, each handed the packet by xdp_prog once
+ * it has decided where the packet goes. They start over from the headers
+ * xdp_prog already checked, and find the rest of what it parsed in
+ * PKT_STATE.
+ */
+#define ROUTE_IPV4_HEADERS() \
+	void *data_start = DATA(ctx); \
+	void *data_end = DATA_END(ctx); \
+	void *data = data_start; \
+	\
+	struct ethhdr *eth = data; \
+	data = eth + 1; \
+	if (data > data_end) \
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP); \
+	\
+	struct iphdr *iph = data; \
+	data = iph + 1; \
+	if (data > data_end) \
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP)
+
 FUNCTION_ATTR
-int xdp_prog(context_t *ctx)
+int xdp_route_nat(context_t *ctx)
 {
-	/* BPF needs sign extension to make sure it's all 1s.
-	 * EMU needs zero extension to make sure it's all 0s.
-	 * Annoying, ikr.
-	 */
+	ROUTE_IPV4_HEADERS();
+	PKT_STATE(st);
+
+	struct dp_config cfg = st->cfg;
+	enum icmp_type icmp_type = st->icmp_type;
+	uint16_t src_port = st->src_port;
+	uint16_t dst_port = st->dst_port;
+
+	if (iph->ttl <= 1) {
+		emit_ttl_exceeded(iph);
+		return VERDICT(XDP_STAT_TTL_EXCEEDED, send_icmp4_timeout_exceeded(ctx, cfg.switch_side_mac));
+	}
+
+	uint64_t ktime_ns = bpf_ktime_get_ns();
+	uint16_t nat_port = 0;
+
+	if (icmp_type == NOT_ICMP || icmp_type == ICMP_TYPE_REQUEST) {
+		struct napt_key out_key = {
+			.saddr = iph->saddr,
+			.daddr = iph->daddr,
+			.sport = src_port,
+			.dport = dst_port,
+			.protocol = iph->protocol,
+		};
+		struct napt_key in_key = {
+			.saddr = iph->daddr,
+			.daddr = RODATA(public_host_ip),
+			.sport = dst_port,
+			.protocol = iph->protocol,
+		};
+		DECLARE_MAP_LOOKUP_VAR(struct napt_entry, out_entry);
+		DECLARE_MAP_LOOKUP_VAR(struct napt_entry, in_entry);
+
+		/* Reuse the flow's port while the inbound side
+		 * still maps back to it, the LRU may have dropped
+		 * either one.
+		 */
+		if (!pkt_map_lookup_elem(nat_out_map, &out_key, out_entry)) {
+			in_key.dport = MAP_LOOKUP_DEREF(out_entry).port;
+
+			if (!pkt_map_lookup_elem(nat_in_map, &in_key, in_entry) &&
+			    MAP_LOOKUP_DEREF(in_entry).addr == iph->saddr &&
+			    MAP_LOOKUP_DEREF(in_entry).port == src_port) {
+				memcpy(MAP_LOOKUP_DEREF(in_entry).h_source,
+				       eth->h_source, sizeof(macaddr_t));
+				MAP_LOOKUP_DEREF(in_entry).ktime_ns = ktime_ns;
+				pkt_map_update_lookup(nat_in_map, &in_key, in_entry);
+
+				nat_port = in_key.dport;
+			}
+		}
+
+		if (!nat_port) {
+			struct napt_entry new_in = {
+				.addr = iph->saddr,
+				.port = src_port,
+				.ktime_ns = ktime_ns,
+			};
+			memcpy(new_in.h_source, eth->h_source, sizeof(macaddr_t));
+
+			nat_port = napt_claim_port(&in_key, &new_in);
+			if (!nat_port) {
+				emit_nat_event(DP_EVENT_NAT_FULL, &out_key, 0);
+				return VERDICT(XDP_STAT_DROP_NAT_PORT, XDP_DROP);
+			}
+
+			struct napt_entry new_out = {
+				.addr = RODATA(public_host_ip),
+				.port = nat_port,
+				.ktime_ns = ktime_ns,
+			};
+			pkt_map_update_elem(nat_out_map, &out_key, &new_out, BPF_ANY);
+
+			emit_nat_event(DP_EVENT_NAT_CREATE, &out_key, nat_port);
+		}
+	} else
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+	ip_decrease_ttl(iph);
+
+	iph->saddr = RODATA(public_host_ip);
+	recompute_iph_csum(iph);
+	recompute_l4_csum_fast(ctx, iph, &st->iphp_orig);
+	if (nat_port != src_port)
+		l4_set_port(ctx, iph, false, nat_port);
+
+	struct fib_nexthop nh;
+	pkt_nexthop(ctx, &cfg, iph->daddr, &nh);
+	memcpy(eth->h_dest, nh.h_dest, sizeof(macaddr_t));
+	memcpy(eth->h_source, nh.h_source, sizeof(macaddr_t));
+
+	return VERDICT(XDP_STAT_NAT_ROUTE, pkt_tx_nexthop(ctx, &nh));
+}
+
+FUNCTION_ATTR
+int xdp_route_vpn_encap(context_t *ctx)
+{
+	PKT_STATE(st);
+
+	struct dp_config cfg = st->cfg;
+	uint32_t slot = st->slot;
+
+	struct connection *conn = pkt_conn_by_slot(slot);
+	if (!conn)
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+	if (bpf_xdp_adjust_head(ctx, 0 - (int)(
+				sizeof(struct iphdr) +
+				sizeof(struct udphdr) +
+				sizeof(uint16_t))))
+		return CONN_VERDICT(slot, XDP_STAT_DROP_ADJUST, XDP_DROP);
+
 	void *data_start = DATA(ctx);
 	void *data_end = DATA_END(ctx);
 	void *data = data_start;
@@ -441,502 +1033,519 @@ int xdp_prog(context_t *ctx)
 	struct ethhdr *eth = data;
 	data = eth + 1;
 	if (data > data_end)
-		return XDP_DROP;
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-	bool eth_is_broadcast = mac_eq(eth->h_dest, BROADCAST_MAC);
-	bool eth_is_multicast = eth->h_dest[0] & 1;
+	struct iphdr *iph = data;
+	data = iph + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
-		enum icmp_type icmp_type = NOT_ICMP;
-		uint16_t src_port, dst_port;
+	struct udphdr *udph = data;
+	data = udph + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-#ifndef __clang__
-		// XXX: GCC inference can't see that some cases are
-		// unreachable if these are uninitialized.
-		src_port = dst_port = 0;
-#endif
+	uint16_t *ishoal_ord = data;
+	data = ishoal_ord + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-		struct iphdr *iph = data;
-		data = iph + 1;
-		if (data > data_end)
-			return XDP_DROP;
+	struct iphdr *iph_o = data;
+	data = iph_o + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-		struct iph_pseudo iphp_orig;
-		ipv4_mk_pheader(iph, &iphp_orig);
+	*ishoal_ord = 0xFFFF;
 
-		uint16_t old_csum;
+	udph->source = bpf_htons(conn->local_port);
+	udph->dest = bpf_htons(conn->remote.port);
+	udph->len = bpf_htons((char *)data_end - (char *)udph);
+	udph->check = 0;
 
-		if (iph->protocol == IPPROTO_TCP) {
-			struct tcphdr *tcph = data;
-			data = tcph + 1;
-			if (data > data_end)
-				return XDP_DROP;
+	iph->ihl = 5;
+	iph->version = 4;
+	iph->tos = 0;
+	iph->tot_len = bpf_htons((char *)data_end - (char *)iph);
+	iph->id = iph_o->id;
+	iph->frag_off = bpf_htons(IP_DF);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = RODATA(public_host_ip);
+	iph->daddr = conn->remote.ip;
 
-			src_port = tcph->source;
-			dst_port = tcph->dest;
+	recompute_iph_csum(iph);
 
-			old_csum = tcph->check;
-			if (!old_csum)
-				old_csum = 0xffff;
-		} else if (iph->protocol == IPPROTO_UDP) {
-			struct udphdr *udph = data;
-			data = udph + 1;
-			if (data > data_end)
-				return XDP_DROP;
+	if (st->icmp_type == NOT_ICMP && st->old_csum) {
+		struct overhead_csum ovh;
+		ipv4_mk_pheader(iph, &ovh.iphp);
+		ovh.udph_n = *udph;
+		ovh.iph_o = *iph_o;
+
+		uint32_t csum = 0;
+		csum = bpf_csum_diff((void *)&st->iphp_orig, sizeof(struct iph_pseudo),
+				     (void *)&ovh, sizeof(struct overhead_csum),
+				     0);
+		udph->check = csum_fold_helper(csum);
+		if (!udph->check)
+			udph->check = 0xffff;
+	}
 
-			src_port = udph->source;
-			dst_port = udph->dest;
+	struct fib_nexthop nh;
+	pkt_nexthop(ctx, &cfg, iph->daddr, &nh);
+	memcpy(eth->h_dest, nh.h_dest, sizeof(macaddr_t));
+	memcpy(eth->h_source, nh.h_source, sizeof(macaddr_t));
+	eth->h_proto = bpf_htons(ETH_P_IP);
 
-			old_csum = udph->check;
+	return CONN_VERDICT(slot, XDP_STAT_VPN_ENCAP, pkt_tx_nexthop(ctx, &nh));
+}
 
-			if (dst_port == bpf_htons(49152) &&
-			    eth_is_broadcast && !BSS(switch_ip)) {
-				BSS(switch_ip) = iph->saddr;
-				memcpy(BSS(switch_mac), eth->h_source, sizeof(macaddr_t));
-			}
-		} else if (iph->protocol == IPPROTO_ICMP) {
-			struct icmphdr *icmph = data;
-			data = icmph + 1;
-			if (data > data_end)
-				return XDP_DROP;
-
-			switch (icmph->type) {
-			case ICMP_ECHOREPLY:
-				icmp_type = ICMP_TYPE_RESP;
-				break;
-			case ICMP_DEST_UNREACH:
-			case ICMP_TIME_EXCEEDED:
-				icmp_type = ICMP_TYPE_ERROR;
-				break;
-			case ICMP_ECHO:
-				icmp_type = ICMP_TYPE_REQUEST;
-				break;
-			default:
-				icmp_type = ICMP_TYPE_OTHER;
-			}
+FUNCTION_ATTR
+int xdp_route_vpn_decap(context_t *ctx)
+{
+	ROUTE_IPV4_HEADERS();
+	PKT_STATE(st);
+
+	struct dp_config cfg = st->cfg;
+	uint16_t src_port = st->src_port;
+	uint32_t slot = st->slot;
+
+	struct connection *conn = pkt_conn_by_slot(slot);
+	if (!conn)
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+	struct udphdr *udph = data;
+	data = udph + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
+
+	uint16_t *ishoal_ord = data;
+	data = ishoal_ord + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
+
+	if (*ishoal_ord != 0xFFFF)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_BAD_ORD, XDP_DROP);
+
+	uint16_t remote_port = ACCESS_ONCE(conn->remote.port);
+	if (src_port != bpf_htons(remote_port)) {
+		if (iph->saddr == RODATA(relay_ip))
+			// This should not happen. Relay should not change port
+			return CONN_VERDICT(slot, XDP_STAT_DROP_RELAY_PORT, XDP_DROP);
+
+		/* The peer's NAT rebound it. conns is shared
+		 * with userspace and the other CPUs, and an
+		 * aligned 16-bit store is seen whole. Userspace
+		 * only catches up on its own copy.
+		 */
+		ACCESS_ONCE(conn->remote.port) = bpf_ntohs(src_port);
+
+		struct dp_event event = {
+			.type = DP_EVENT_PORT_REMAP,
+			.remap = {
+				.local_ip = conn->local_ip,
+				.old_port = remote_port,
+				.new_port = bpf_ntohs(src_port),
+			},
+		};
+		pkt_emit_event(&event);
+	}
+
+	if (bpf_xdp_adjust_head(ctx,
+				sizeof(struct iphdr) +
+				sizeof(struct udphdr) +
+				sizeof(uint16_t)))
+		return CONN_VERDICT(slot, XDP_STAT_DROP_ADJUST, XDP_DROP);
+
+	data_start = DATA(ctx);
+	data_end = DATA_END(ctx);
+	data = data_start;
+
+	eth = data;
+	data = eth + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
+
+	iph = data;
+	data = iph + 1;
+	if (data > data_end)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_MALFORMED, XDP_DROP);
+
+	if (iph->ihl != 5 || iph->version != 4)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_BAD_INNER, XDP_DROP);
+
+	ipaddr_t subnet_broadcast =
+		((cfg.switch_ip & RODATA(subnet_mask)) | ~RODATA(subnet_mask));
+	if (iph->daddr != cfg.switch_ip &&
+	    iph->daddr != subnet_broadcast &&
+	    iph->daddr != 0xFFFFFFFFUL &&
+	    (bpf_ntohl(iph->daddr) & 0xF0000000UL) != 0xE0000000UL)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_BAD_INNER, XDP_DROP);
+
+	if (iph->saddr != conn->local_ip)
+		return CONN_VERDICT(slot, XDP_STAT_DROP_BAD_INNER, XDP_DROP);
+
+	memcpy(eth->h_dest, cfg.switch_mac, sizeof(macaddr_t));
+	memcpy(eth->h_source, cfg.switch_side_mac, sizeof(macaddr_t));
+	eth->h_proto = bpf_htons(ETH_P_IP);
+
+	return CONN_VERDICT(slot, XDP_STAT_VPN_DECAP, pkt_tx_port(ctx, TX_PORT_SWITCH));
+}
+
+FUNCTION_ATTR
+int xdp_route_nat_return(context_t *ctx)
+{
+	ROUTE_IPV4_HEADERS();
+	PKT_STATE(st);
+
+	struct dp_config cfg = st->cfg;
+	enum icmp_type icmp_type = st->icmp_type;
+	uint16_t src_port = st->src_port;
+	uint16_t dst_port = st->dst_port;
+
+	if (iph->ttl <= 1) {
+		emit_ttl_exceeded(iph);
+		return VERDICT(XDP_STAT_TTL_EXCEEDED, send_icmp4_timeout_exceeded(ctx, cfg.host_mac));
+	}
+
+	uint16_t nat_port = 0;
+	struct napt_key in_key;
+	DECLARE_MAP_LOOKUP_VAR(struct napt_entry, napt_entry);
+
+	/* Without the L4 header ICMP errors quote, which
+	 * has to be translated back as well.
+	 */
+	struct icmphdr *icmph = (void *)(iph + 1);
+	struct icmperrpl *icmp_pl = (void *)(icmph + 1);
+	struct icmperrpl icmp_pl_copy;
+
+	if (icmp_type == NOT_ICMP || icmp_type == ICMP_TYPE_RESP) {
+		in_key = (struct napt_key) {
+			.saddr = iph->saddr,
+			.daddr = iph->daddr,
+			.sport = src_port,
+			.dport = dst_port,
+			.protocol = iph->protocol,
+		};
+	} else if (icmp_type == ICMP_TYPE_ERROR) {
+		if ((void *)(icmp_pl + 1) > data_end)
+			return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+		icmp_pl_copy = *icmp_pl;
+
+		/* Source and dest lead both headers */
+		static_assert(__builtin_offsetof(struct tcphdr, dest) == 2 &&
+			      __builtin_offsetof(struct udphdr, dest) == 2,
+			      "Bad L4 port offset");
+		uint16_t *ports = (void *)&icmp_pl->ipdat;
+		struct icmphdr *inner_icmph = (void *)&icmp_pl->ipdat;
+		uint16_t inner_sport, inner_dport;
+
+		if (icmp_pl->iph.protocol == IPPROTO_TCP ||
+		    icmp_pl->iph.protocol == IPPROTO_UDP) {
+			inner_sport = ports[0];
+			inner_dport = ports[1];
+		} else if (icmp_pl->iph.protocol == IPPROTO_ICMP &&
+			   inner_icmph->type == ICMP_ECHO) {
+			inner_sport = inner_icmph->un.echo.id;
+			inner_dport = 0;
 		} else
-			return XDP_PASS;
-
-		if (!eth_is_multicast && BSS(fake_gateway_ip) &&
-		    (mac_eq(BSS(switch_mac), eth->h_source) || mac_eq(BSS(switch_mac), (macaddr_t){0})) &&
-		    same_subnet(iph->saddr, BSS(fake_gateway_ip), BSS(subnet_mask)) &&
-		    !same_subnet(iph->daddr, BSS(fake_gateway_ip), BSS(subnet_mask)) &&
-		    // FIXME: should this be 'real subnet mask'?
-		    !same_subnet(iph->daddr, BSS(public_host_ip), BSS(subnet_mask))) {
-			/* NAT route */
-			if (iph->ttl <= 1)
-				return send_icmp4_timeout_exceeded(ctx);
-
-			struct track_entry track_entry = {
-				.saddr = iph->saddr,
-				.ktime_ns = bpf_ktime_get_ns(),
-			};
+			return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+		/* The quoted packet is what the NAT route sent */
+		in_key = (struct napt_key) {
+			.saddr = icmp_pl->iph.daddr,
+			.daddr = icmp_pl->iph.saddr,
+			.sport = inner_dport,
+			.dport = inner_sport,
+			.protocol = icmp_pl->iph.protocol,
+		};
+	} else
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+	if (pkt_map_lookup_elem(nat_in_map, &in_key, napt_entry))
+		return VERDICT(XDP_STAT_PASS_UNTRACKED, XDP_PASS);
+	// 5 minutes expiry
+	if (track_expired(MAP_LOOKUP_DEREF(napt_entry).ktime_ns,
+			  5 * 60 * SECOND_NS)) {
+		struct napt_key out_key = {
+			.saddr = MAP_LOOKUP_DEREF(napt_entry).addr,
+			.daddr = in_key.saddr,
+			.sport = MAP_LOOKUP_DEREF(napt_entry).port,
+			.dport = in_key.sport,
+			.protocol = in_key.protocol,
+		};
+		emit_nat_event(DP_EVENT_NAT_EXPIRE, &out_key, in_key.dport);
+
+		pkt_map_delete_elem(nat_in_map, &in_key);
+		return VERDICT(XDP_STAT_PASS_UNTRACKED, XDP_PASS);
+	}
+	MAP_LOOKUP_DEREF(napt_entry).ktime_ns = bpf_ktime_get_ns();
+	pkt_map_update_lookup(nat_in_map, &in_key, napt_entry);
+
+	ipaddr_t daddr = MAP_LOOKUP_DEREF(napt_entry).addr;
+	macaddr_t h_source;
+	memcpy(h_source, MAP_LOOKUP_DEREF(napt_entry).h_source, sizeof(macaddr_t));
+	nat_port = MAP_LOOKUP_DEREF(napt_entry).port;
+
+	if (icmp_type == ICMP_TYPE_ERROR) {
+		struct iph_pseudo inner_iphp_orig;
+		ipv4_mk_pheader(&icmp_pl->iph, &inner_iphp_orig);
+
+		icmp_pl->iph.saddr = daddr;
+		recompute_iph_csum(&icmp_pl->iph);
+
+		uint16_t l4_delta = recompute_l4_csum_fast(ctx, &icmp_pl->iph, &inner_iphp_orig);
+		l4_delta = onec_add(l4_delta, l4_set_port(ctx, &icmp_pl->iph, false, nat_port));
+
+		/* The quoted 8 bytes are diffed whole, which
+		 * takes care of every L4 checksum but TCP's.
+		 */
+		if (icmp_pl->iph.protocol != IPPROTO_TCP)
+			l4_delta = 0;
+
+		uint32_t csum = 0;
+		csum = bpf_csum_diff((void *)&icmp_pl_copy, sizeof(icmp_pl_copy),
+				     (void *)icmp_pl, sizeof(*icmp_pl),
+				     ~icmph->checksum);
+		csum = csum_fold_helper(csum);
+		csum = onec_add(~csum, l4_delta);
+		icmph->checksum = ~csum;
+	}
 
-			if (icmp_type == NOT_ICMP) {
-				struct conntrack_key conntrack_key = {
-					.protocol = iph->protocol,
-					.sport = src_port,
-				};
-				memcpy(track_entry.h_source, eth->h_source, sizeof(macaddr_t));
+	iph->daddr = daddr;
 
-				pkt_map_update_elem(conntrack_map, &conntrack_key,
-						    &track_entry, BPF_ANY);
-			} else if (icmp_type == ICMP_TYPE_REQUEST) {
-				struct icmphdr *icmph_old = (void *)(iph + 1);
-				struct icmphdr *icmph_new;
+	ip_decrease_ttl(iph);
 
-				struct icmp_echotrack_key icmp_echotrack_key = {
-					.length = data_end - (void *)icmph_old,
-				};
+	recompute_iph_csum(iph);
+	recompute_l4_csum_fast(ctx, iph, &st->iphp_orig);
+	if (icmp_type != ICMP_TYPE_ERROR && nat_port != dst_port)
+		l4_set_port(ctx, iph, true, nat_port);
 
-				icmph_new = (void *)icmp_echotrack_key.data;
-				memcpy_dyn(icmph_new, icmph_old, data_end, ICMP_ECHOTRACK_SIZE);
+	memcpy(eth->h_dest, h_source, sizeof(macaddr_t));
+	memcpy(eth->h_source, cfg.switch_side_mac, sizeof(macaddr_t));
 
-				if (icmph_new->type != ICMP_ECHO)
-					return XDP_DROP;
-				icmph_new->type = ICMP_ECHOREPLY;
+	return VERDICT(XDP_STAT_NAT_RETURN, pkt_tx_port(ctx, TX_PORT_SWITCH));
+}
 
-				uint32_t check = (uint32_t)icmph_new->checksum;
-				check += (uint32_t)bpf_htons(0x0800);
-				icmph_new->checksum = (uint16_t)(check + (check >= 0xFFFF));
+FUNCTION_ATTR
+int xdp_route_arp_proxy(context_t *ctx)
+{
+	void *data_start = DATA(ctx);
+	void *data_end = DATA_END(ctx);
+	void *data = data_start;
 
-				memcpy(track_entry.h_source, eth->h_source, sizeof(macaddr_t));
+	struct ethhdr *eth = data;
+	data = eth + 1;
+	if (data > data_end)
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-				pkt_map_update_elem(icmp_echotrack_map, &icmp_echotrack_key,
-						    &track_entry, BPF_ANY);
-				pkt_map_update_elem(icmp_echoerrtrack_map, icmph_old,
-						    &track_entry, BPF_ANY);
-			} else
-				return XDP_PASS;
+	PKT_STATE(st);
 
-			ip_decrease_ttl(iph);
+	struct dp_config cfg = st->cfg;
 
-			iph->saddr = BSS(public_host_ip);
-			recompute_iph_csum(iph);
-			recompute_l4_csum_fast(ctx, iph, &iphp_orig);
+	struct arphdr *arph = data;
+	data = arph + 1;
+	if (data > data_end)
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-			memcpy(eth->h_dest, BSS(gateway_mac), sizeof(macaddr_t));
-			memcpy(eth->h_source, BSS(host_mac), sizeof(macaddr_t));
+	if (arph->ar_pro != bpf_htons(ETH_P_IP) ||
+	    arph->ar_hln != 6 ||
+	    arph->ar_pln != 4 ||
+	    arph->ar_op != bpf_htons(ARPOP_REQUEST))
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
 
-			return XDP_TX;
-		}
+	struct arp_ipv4_payload *arppl = data;
+	data = arppl + 1;
+	if (data > data_end)
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-		if (mac_eq(BSS(switch_mac), eth->h_source)) {
-			if (eth_is_multicast) {
-				if (iph->protocol == IPPROTO_UDP &&
-				    dst_port == bpf_htons(67) &&
-				    dst_port == bpf_htons(68))
-					// DHCP
-					return XDP_PASS;
+	if (arppl->ar_tip != RODATA(fake_gateway_ip) &&
+	    !pkt_conn_by_ip(arppl->ar_tip, NULL))
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
 
-				/* VPN broadcast route */
-#ifdef __BPF__
-				return redirect_to_userspace(ctx);
-#else
-				broadcast_all_remotes(iph, data_end - (void *)iph);
-				return XDP_DROP;
+	ipaddr_t tmp_ip;
+
+	memcpy(arppl->ar_tha, arppl->ar_sha, sizeof(macaddr_t));
+	memcpy(arppl->ar_sha, cfg.switch_side_mac, sizeof(macaddr_t));
+
+	tmp_ip = arppl->ar_tip;
+	arppl->ar_tip = arppl->ar_sip;
+	arppl->ar_sip = tmp_ip;
+
+	arph->ar_op = bpf_htons(ARPOP_REPLY);
+
+	memcpy(eth->h_dest, eth->h_source, sizeof(macaddr_t));
+	memcpy(eth->h_source, cfg.switch_side_mac, sizeof(macaddr_t));
+
+	return VERDICT(XDP_STAT_ARP_PROXY, XDP_TX);
+}
+
+#ifndef __BPF__
+static int (*const xdpemu_routes[XDP_ROUTE_MAX])(context_t *ctx) = {
+	[XDP_ROUTE_NAT] = xdp_route_nat,
+	[XDP_ROUTE_NAT_RETURN] = xdp_route_nat_return,
+	[XDP_ROUTE_VPN_ENCAP] = xdp_route_vpn_encap,
+	[XDP_ROUTE_VPN_DECAP] = xdp_route_vpn_decap,
+	[XDP_ROUTE_ARP_PROXY] = xdp_route_arp_proxy,
+};
 #endif
-			}
 
-			DECLARE_MAP_LOOKUP_VAR(struct connection, conn);
-			if (pkt_map_lookup_elem(conn_by_ip, &iph->daddr, conn))
-				return XDP_PASS;
-
-			/* VPN route */
-			if (bpf_xdp_adjust_head(ctx, 0 - (int)(
-						sizeof(struct iphdr) +
-						sizeof(struct udphdr) +
-						sizeof(uint16_t))))
-				return XDP_DROP;
-
-			data_start = DATA(ctx);
-			data_end = DATA_END(ctx);
-			data = data_start;
-
-			eth = data;
-			data = eth + 1;
-			if (data > data_end)
-				return XDP_DROP;
-
-			iph = data;
-			data = iph + 1;
-			if (data > data_end)
-				return XDP_DROP;
-
-			struct udphdr *udph = data;
-			data = udph + 1;
-			if (data > data_end)
-				return XDP_DROP;
-
-			uint16_t *ishoal_ord = data;
-			data = ishoal_ord + 1;
-			if (data > data_end)
-				return XDP_DROP;
-
-			struct iphdr *iph_o = data;
-			data = iph_o + 1;
-			if (data > data_end)
-				return XDP_DROP;
-
-			*ishoal_ord = 0xFFFF;
-
-			udph->source = bpf_htons(MAP_LOOKUP_DEREF(conn).local_port);
-			udph->dest = bpf_htons(MAP_LOOKUP_DEREF(conn).remote.port);
-			udph->len = bpf_htons((char *)data_end - (char *)udph);
-			udph->check = 0;
-
-			iph->ihl = 5;
-			iph->version = 4;
-			iph->tos = 0;
-			iph->tot_len = bpf_htons((char *)data_end - (char *)iph);
-			iph->id = iph_o->id;
-			iph->frag_off = bpf_htons(IP_DF);
-			iph->ttl = 64;
-			iph->protocol = IPPROTO_UDP;
-			iph->saddr = BSS(public_host_ip);
-			iph->daddr = MAP_LOOKUP_DEREF(conn).remote.ip;
-
-			recompute_iph_csum(iph);
-
-			if (icmp_type == NOT_ICMP) {
-				/* ACCESS_ONCE here to prevent reordering causing
-				 * verifier failures -- old_csum is uninitialized
-				 */
-				if (ACCESS_ONCE(old_csum)) {
-					struct overhead_csum ovh;
-					ipv4_mk_pheader(iph, &ovh.iphp);
-					ovh.udph_n = *udph;
-					ovh.iph_o = *iph_o;
-
-					uint32_t csum = 0;
-					csum = bpf_csum_diff((void *)&iphp_orig, sizeof(struct iph_pseudo),
-						             (void *)&ovh, sizeof(struct overhead_csum),
-						             0);
-					udph->check = csum_fold_helper(csum);
-					if (!udph->check)
-						udph->check = 0xffff;
-				}
-			}
+/* Parses the packet and picks its route, which takes it from there */
+FUNCTION_ATTR
+int xdp_prog(context_t *ctx)
+{
+	/* BPF needs sign extension to make sure it's all 1s.
+	 * EMU needs zero extension to make sure it's all 0s.
+	 * Annoying, ikr.
+	 */
+	void *data_start = DATA(ctx);
+	void *data_end = DATA_END(ctx);
+	void *data = data_start;
 
-			memcpy(eth->h_dest, BSS(gateway_mac), sizeof(macaddr_t));
-			memcpy(eth->h_source, BSS(host_mac), sizeof(macaddr_t));
-			eth->h_proto = bpf_htons(ETH_P_IP);
+	struct ethhdr *eth = data;
+	data = eth + 1;
+	if (data > data_end)
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-			return XDP_TX;
-		}
+	PKT_STATE(st);
 
-		if (iph->daddr == BSS(public_host_ip)) {
-			if (iph->protocol == IPPROTO_UDP) {
-				DECLARE_MAP_LOOKUP_VAR(struct connection, conn);
-				uint16_t dst_port_key = bpf_ntohs(dst_port);
-				if (pkt_map_lookup_elem(conn_by_port, &dst_port_key, conn))
-					goto gateway_return;
+	config_read(&st->cfg);
 
-				if (iph->saddr != MAP_LOOKUP_DEREF(conn).remote.ip)
-					goto gateway_return;
+	bool from_switch_side = pkt_from_switch_side(ctx);
 
-				uint16_t *ishoal_ord = data;
-				data = ishoal_ord + 1;
-				if (data > data_end)
-					return XDP_DROP;
+	if (eth->h_proto == bpf_htons(ETH_P_ARP)) {
+		if (!from_switch_side)
+			return VERDICT(XDP_STAT_PASS, XDP_PASS);
+		return ROUTE_TO(XDP_ROUTE_ARP_PROXY);
+	}
+	if (eth->h_proto != bpf_htons(ETH_P_IP))
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
 
-				if (*ishoal_ord != 0xFFFF)
-					return XDP_DROP;
+	bool eth_is_broadcast = mac_eq(eth->h_dest, BROADCAST_MAC);
+	bool eth_is_multicast = eth->h_dest[0] & 1;
 
-				if (src_port != bpf_htons(MAP_LOOKUP_DEREF(conn).remote.port)) {
-					if (iph->saddr == BSS(relay_ip))
-						// This should not happen. Relay should not change port
-						return XDP_DROP;
-#ifdef __BPF__
-					return redirect_to_userspace(ctx);
-#else
-					update_connection_remote_port(
-						MAP_LOOKUP_DEREF(conn).local_ip, bpf_ntohl(src_port));
+	struct iphdr *iph = data;
+	data = iph + 1;
+	if (data > data_end)
+		return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-					MAP_LOOKUP_DEREF(conn).remote.port = bpf_ntohl(src_port);
-					pkt_map_update_lookup(conn_by_port, &dst_port_key, conn);
-					pkt_map_update_lookup(conn_by_ip, &MAP_LOOKUP_DEREF(conn).local_ip, conn);
-#endif
-				}
-
-				/* VPN route */
-				if (bpf_xdp_adjust_head(ctx,
-							sizeof(struct iphdr) +
-							sizeof(struct udphdr) +
-							sizeof(uint16_t)))
-					return XDP_DROP;
-
-				data_start = DATA(ctx);
-				data_end = DATA_END(ctx);
-				data = data_start;
-
-				eth = data;
-				data = eth + 1;
-				if (data > data_end)
-					return XDP_DROP;
-
-				iph = data;
-				data = iph + 1;
-				if (data > data_end)
-					return XDP_DROP;
-
-				if (iph->ihl != 5 || iph->version != 4)
-					return XDP_DROP;
-
-				ipaddr_t subnet_broadcast =
-					((BSS(switch_ip) & BSS(subnet_mask)) | ~BSS(subnet_mask));
-				if (iph->daddr != BSS(switch_ip) &&
-				    iph->daddr != subnet_broadcast &&
-				    iph->daddr != 0xFFFFFFFFUL &&
-				    (bpf_ntohl(iph->daddr) & 0xF0000000UL) != 0xE0000000UL)
-					return XDP_DROP;
-
-				if (iph->saddr != MAP_LOOKUP_DEREF(conn).local_ip)
-					return XDP_DROP;
-
-				memcpy(eth->h_dest, BSS(switch_mac), sizeof(macaddr_t));
-				memcpy(eth->h_source, BSS(host_mac), sizeof(macaddr_t));
-				eth->h_proto = bpf_htons(ETH_P_IP);
-
-				return XDP_TX;
-			}
+	ipv4_mk_pheader(iph, &st->iphp_orig);
 
-gateway_return:
-			if (BSS(fake_gateway_ip) &&
-			    !same_subnet(iph->saddr, BSS(fake_gateway_ip), BSS(subnet_mask))) {
-				/* NAT return route */
-				if (iph->ttl <= 1)
-					return send_icmp4_timeout_exceeded(ctx);
-
-				macaddr_t h_source;
-				DECLARE_MAP_LOOKUP_VAR(struct track_entry, track_entry);
-
-				if (icmp_type == NOT_ICMP) {
-					struct conntrack_key conntrack_key = {
-						.protocol = iph->protocol,
-						.sport = dst_port,
-					};
-
-					if (pkt_map_lookup_elem(conntrack_map, &conntrack_key, track_entry))
-						return XDP_PASS;
-					// 5 minutes expiry
-					if (bpf_ktime_get_ns() - MAP_LOOKUP_DEREF(track_entry).ktime_ns
-					    > 5 * 60 * SECOND_NS) {
-						pkt_map_delete_elem(conntrack_map, &conntrack_key);
-						return XDP_PASS;
-					}
-					MAP_LOOKUP_DEREF(track_entry).ktime_ns = bpf_ktime_get_ns();
-					pkt_map_update_lookup(conntrack_map, &conntrack_key, track_entry);
-				} else if (icmp_type == ICMP_TYPE_RESP) {
-					struct icmphdr *icmph_old = (void *)(iph + 1);
-					struct icmphdr *icmph_new;
-
-					struct icmp_echotrack_key icmp_echotrack_key = {
-						.length = data_end - (void *)icmph_old,
-					};
-
-					icmph_new = (void *)icmp_echotrack_key.data;
-					memcpy_dyn(icmph_new, icmph_old, data_end, ICMP_ECHOTRACK_SIZE);
-
-					if (icmph_new->type != ICMP_ECHOREPLY)
-						return XDP_DROP;
-
-					if (pkt_map_lookup_elem(icmp_echotrack_map, &icmp_echotrack_key, track_entry))
-						return XDP_PASS;
-					// 5 minutes expiry
-					if (bpf_ktime_get_ns() - MAP_LOOKUP_DEREF(track_entry).ktime_ns
-					    > 5 * 60 * SECOND_NS) {
-						pkt_map_delete_elem(icmp_echotrack_map, &icmp_echotrack_key);
-						return XDP_PASS;
-					}
-					MAP_LOOKUP_DEREF(track_entry).ktime_ns = bpf_ktime_get_ns();
-					pkt_map_update_lookup(icmp_echotrack_map, &icmp_echotrack_key, track_entry);
-				} else if (icmp_type == ICMP_TYPE_ERROR) {
-					struct icmphdr *icmph = (void *)(iph + 1);
-					struct icmperrpl *icmp_pl = (void *)(icmph + 1);
-
-					if ((void *)(icmp_pl + 1) > data_end)
-						return XDP_PASS;
-
-					struct icmperrpl icmp_pl_copy = *icmp_pl;
-
-					if (icmp_pl->iph.protocol == IPPROTO_ICMP) {
-						if (pkt_map_lookup_elem(icmp_echoerrtrack_map, &icmp_pl->ipdat, track_entry))
-							return XDP_PASS;
-						// 5 minutes expiry
-						if (bpf_ktime_get_ns() - MAP_LOOKUP_DEREF(track_entry).ktime_ns
-						    > 5 * 60 * SECOND_NS) {
-							pkt_map_delete_elem(icmp_echoerrtrack_map, &icmp_pl->ipdat);
-							return XDP_PASS;
-						}
-						MAP_LOOKUP_DEREF(track_entry).ktime_ns = bpf_ktime_get_ns();
-						pkt_map_update_lookup(icmp_echoerrtrack_map, &icmp_pl->ipdat, track_entry);
-					} else {
-						uint16_t port;
-
-						if (icmp_pl->iph.protocol == IPPROTO_TCP) {
-							struct tcphdr *tcph = (void *)&icmp_pl->ipdat;
-							static_assert(__builtin_offsetof(struct tcphdr, source) +
-								      sizeof(tcph->source) <=
-								      sizeof(icmp_pl->ipdat),
-								      "Bad TCP port offset");
-							port = tcph->source;
-						} else if (icmp_pl->iph.protocol == IPPROTO_UDP) {
-							struct tcphdr *udph = (void *)&icmp_pl->ipdat;
-							static_assert(__builtin_offsetof(struct udphdr, source) +
-								      sizeof(udph->source) <=
-								      sizeof(icmp_pl->ipdat),
-								      "Bad UDP port offset");
-							port = udph->source;
-						} else
-							return XDP_PASS;
-
-						struct conntrack_key conntrack_key = {
-							.protocol = icmp_pl->iph.protocol,
-							.sport = port,
-						};
-
-						if (pkt_map_lookup_elem(conntrack_map, &conntrack_key, track_entry))
-							return XDP_PASS;
-						// 5 minutes expiry
-						if (bpf_ktime_get_ns() - MAP_LOOKUP_DEREF(track_entry).ktime_ns
-						    > 5 * 60 * SECOND_NS) {
-							pkt_map_delete_elem(conntrack_map, &conntrack_key);
-							return XDP_PASS;
-						}
-						MAP_LOOKUP_DEREF(track_entry).ktime_ns = bpf_ktime_get_ns();
-						pkt_map_update_lookup(conntrack_map, &conntrack_key, track_entry);
-					}
-
-					struct iph_pseudo inner_iphp_orig;
-					ipv4_mk_pheader(&icmp_pl->iph, &inner_iphp_orig);
-
-					icmp_pl->iph.saddr = MAP_LOOKUP_DEREF(track_entry).saddr;
-					recompute_iph_csum(&icmp_pl->iph);
-
-					uint32_t csum = 0;
-					csum = bpf_csum_diff((void *)&icmp_pl_copy.iph, sizeof(icmp_pl_copy.iph),
-							     (void *)&icmp_pl->iph, sizeof(icmp_pl->iph),
-							     ~icmph->checksum);
-					csum = csum_fold_helper(csum);
-					csum = onec_add(~csum, recompute_l4_csum_fast(ctx, &icmp_pl->iph, &inner_iphp_orig));
-					icmph->checksum = ~csum;
-				} else
-					return XDP_PASS;
-
-				iph->daddr = MAP_LOOKUP_DEREF(track_entry).saddr;
-				memcpy(h_source, MAP_LOOKUP_DEREF(track_entry).h_source, sizeof(macaddr_t));
-
-				ip_decrease_ttl(iph);
-
-				recompute_iph_csum(iph);
-				recompute_l4_csum_fast(ctx, iph, &iphp_orig);
-
-				memcpy(eth->h_dest, h_source, sizeof(macaddr_t));
-				memcpy(eth->h_source, BSS(host_mac), sizeof(macaddr_t));
-
-				return XDP_TX;
-			}
-		}
+	st->icmp_type = NOT_ICMP;
+	st->src_port = st->dst_port = 0;
+	st->old_csum = 0;
 
-		return XDP_PASS;
-	} else if (eth->h_proto == bpf_htons(ETH_P_ARP)) {
-		struct arphdr *arph = data;
-		data = arph + 1;
+	if (iph->protocol == IPPROTO_TCP) {
+		struct tcphdr *tcph = data;
+		data = tcph + 1;
 		if (data > data_end)
-			return XDP_DROP;
+			return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-		if (arph->ar_pro != bpf_htons(ETH_P_IP) ||
-		    arph->ar_hln != 6 ||
-		    arph->ar_pln != 4 ||
-		    arph->ar_op != bpf_htons(ARPOP_REQUEST))
-			return XDP_PASS;
+		st->src_port = tcph->source;
+		st->dst_port = tcph->dest;
 
-		struct arp_ipv4_payload *arppl = data;
-		data = arppl + 1;
+		st->old_csum = tcph->check;
+		if (!st->old_csum)
+			st->old_csum = 0xffff;
+	} else if (iph->protocol == IPPROTO_UDP) {
+		struct udphdr *udph = data;
+		data = udph + 1;
 		if (data > data_end)
-			return XDP_DROP;
+			return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
 
-		DECLARE_MAP_LOOKUP_VAR(struct connection, conn);
-		if (arppl->ar_tip != BSS(fake_gateway_ip) &&
-		    pkt_map_lookup_elem(conn_by_ip, &arppl->ar_tip, conn))
-			return XDP_PASS;
+		st->src_port = udph->source;
+		st->dst_port = udph->dest;
 
-		ipaddr_t tmp_ip;
+		st->old_csum = udph->check;
 
-		memcpy(arppl->ar_tha, arppl->ar_sha, sizeof(macaddr_t));
-		memcpy(arppl->ar_sha, BSS(host_mac), sizeof(macaddr_t));
+		if (st->dst_port == bpf_htons(49152) && from_switch_side &&
+		    eth_is_broadcast && !st->cfg.switch_ip) {
+			/* Userspace publishes it, go on as if it had */
+			struct dp_event event = {
+				.type = DP_EVENT_SWITCH_DETECTED,
+				.sw.ip = iph->saddr,
+			};
+			memcpy(event.sw.mac, eth->h_source, sizeof(macaddr_t));
+			pkt_emit_event(&event);
 
-		tmp_ip = arppl->ar_tip;
-		arppl->ar_tip = arppl->ar_sip;
-		arppl->ar_sip = tmp_ip;
+			st->cfg.switch_ip = iph->saddr;
+			memcpy(st->cfg.switch_mac, eth->h_source, sizeof(macaddr_t));
+		}
+	} else if (iph->protocol == IPPROTO_ICMP) {
+		struct icmphdr *icmph = data;
+		data = icmph + 1;
+		if (data > data_end)
+			return VERDICT(XDP_STAT_DROP_MALFORMED, XDP_DROP);
+
+		switch (icmph->type) {
+		/* The echo identifier stands in for the ports, as
+		 * the source for requests and the dest for replies.
+		 */
+		case ICMP_ECHOREPLY:
+			st->icmp_type = ICMP_TYPE_RESP;
+			st->dst_port = icmph->un.echo.id;
+			break;
+		case ICMP_DEST_UNREACH:
+		case ICMP_TIME_EXCEEDED:
+			st->icmp_type = ICMP_TYPE_ERROR;
+			break;
+		case ICMP_ECHO:
+			st->icmp_type = ICMP_TYPE_REQUEST;
+			st->src_port = icmph->un.echo.id;
+			break;
+		default:
+			st->icmp_type = ICMP_TYPE_OTHER;
+		}
+	} else
+		return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+	if (from_switch_side && !eth_is_multicast && RODATA(fake_gateway_ip) &&
+	    (mac_eq(st->cfg.switch_mac, eth->h_source) ||
+	     mac_eq(st->cfg.switch_mac, (macaddr_t){0})) &&
+	    same_subnet(iph->saddr, RODATA(fake_gateway_ip), RODATA(subnet_mask)) &&
+	    !same_subnet(iph->daddr, RODATA(fake_gateway_ip), RODATA(subnet_mask)) &&
+	    // FIXME: should this be 'real subnet mask'?
+	    !same_subnet(iph->daddr, RODATA(public_host_ip), RODATA(subnet_mask)))
+		return ROUTE_TO(XDP_ROUTE_NAT);
+
+	if (from_switch_side && mac_eq(st->cfg.switch_mac, eth->h_source)) {
+		if (eth_is_multicast) {
+			if (iph->protocol == IPPROTO_UDP &&
+			    (st->dst_port == bpf_htons(67) ||
+			     st->dst_port == bpf_htons(68)))
+				// DHCP
+				return VERDICT(XDP_STAT_PASS, XDP_PASS);
+
+			/* VPN broadcast route */
+#ifdef __BPF__
+			if (RODATA(tc_broadcast))
+				/* Replicated by tc_broadcast_prog */
+				return VERDICT(XDP_STAT_VPN_BROADCAST, XDP_PASS);
+			return VERDICT(XDP_STAT_TO_USERSPACE, redirect_to_userspace(ctx));
+#else
+			broadcast_all_remotes(iph, data_end - (void *)iph);
+			return VERDICT(XDP_STAT_VPN_BROADCAST, XDP_DROP);
+#endif
+		}
+
+		if (!pkt_conn_by_ip(iph->daddr, &st->slot))
+			return VERDICT(XDP_STAT_PASS, XDP_PASS);
 
-		arph->ar_op = bpf_htons(ARPOP_REPLY);
+		return ROUTE_TO(XDP_ROUTE_VPN_ENCAP);
+	}
 
-		memcpy(eth->h_dest, eth->h_source, sizeof(macaddr_t));
-		memcpy(eth->h_source, BSS(host_mac), sizeof(macaddr_t));
+	if (iph->daddr == RODATA(public_host_ip)) {
+		if (iph->protocol == IPPROTO_UDP) {
+			struct connection *conn =
+				pkt_conn_by_port(bpf_ntohs(st->dst_port), &st->slot);
+			if (conn && iph->saddr == conn->remote.ip)
+				return ROUTE_TO(XDP_ROUTE_VPN_DECAP);
+		}
 
-		return XDP_TX;
-	} else
-		return XDP_PASS;
+		if (RODATA(fake_gateway_ip) &&
+		    !same_subnet(iph->saddr, RODATA(fake_gateway_ip), RODATA(subnet_mask)))
+			return ROUTE_TO(XDP_ROUTE_NAT_RETURN);
+	}
+
+	return VERDICT(XDP_STAT_PASS, XDP_PASS);
 }
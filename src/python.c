@@ -635,6 +635,77 @@ ishoalc_delete_connection(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+static PyObject *
+ishoalc_get_xdp_stats(PyObject *self, PyObject *args)
+{
+    struct xdp_stat_entry stats[XDP_STAT_MAX];
+
+    xdp_stats_read(stats);
+
+    PyObject *dict = PyDict_New();
+    if (!dict)
+        return NULL;
+
+    for (int stat = 0; stat < XDP_STAT_MAX; stat++) {
+        PyObject *value = Py_BuildValue("(KK)",
+                                        (unsigned long long)stats[stat].packets,
+                                        (unsigned long long)stats[stat].bytes);
+        if (!value ||
+            PyDict_SetItemString(dict, xdp_stat_name(stat), value)) {
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+
+    return dict;
+}
+
+static void
+ishoalc_connection_stats_cb(const struct connection *conn,
+                            const struct conn_stats *stats, void *ctx)
+{
+    PyObject *dict = ctx;
+    char str[IP_STR_BULEN];
+
+    if (PyErr_Occurred())
+        return;
+
+    ip_str(conn->local_ip, str);
+
+    PyObject *value = Py_BuildValue(
+        "{sKsKsKsKsKsK}",
+        "tx_packets", (unsigned long long)stats->tx_packets,
+        "tx_bytes", (unsigned long long)stats->tx_bytes,
+        "rx_packets", (unsigned long long)stats->rx_packets,
+        "rx_bytes", (unsigned long long)stats->rx_bytes,
+        "drops", (unsigned long long)stats->drops,
+        "last_seen_ns", (unsigned long long)stats->last_seen_ns);
+    if (!value)
+        return;
+
+    PyDict_SetItemString(dict, str, value);
+    Py_DECREF(value);
+}
+
+static PyObject *
+ishoalc_get_connection_stats(PyObject *self, PyObject *args)
+{
+    PyObject *dict = PyDict_New();
+    if (!dict)
+        return NULL;
+
+    bpf_connection_stats_foreach(ishoalc_connection_stats_cb, dict);
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    return dict;
+}
+
 static PyMethodDef IshoalcMethods[] = {
     {"thread_all_stop", ishoalc_thread_all_stop, METH_NOARGS, NULL},
     {"should_stop", ishoalc_should_stop, METH_NOARGS, NULL},
@@ -654,6 +725,8 @@ static PyMethodDef IshoalcMethods[] = {
     {"get_version", ishoalc_get_version, METH_NOARGS, NULL},
     {"add_connection", ishoalc_add_connection, METH_VARARGS, NULL},
     {"delete_connection", ishoalc_delete_connection, METH_VARARGS, NULL},
+    {"get_xdp_stats", ishoalc_get_xdp_stats, METH_NOARGS, NULL},
+    {"get_connection_stats", ishoalc_get_connection_stats, METH_NOARGS, NULL},
     {NULL, NULL, 0, NULL}
 };
 
@@ -1,15 +1,18 @@
 #include "features.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <net/if.h>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <urcu.h>
 #include <urcu/rculfhash.h>
 
@@ -42,6 +45,153 @@ static FILE *remotes_log;
 
 static struct thread *keepalive_thread;
 
+/* Datagrams to every remote are sent on one raw socket, with the outer
+ * IP and UDP headers built here, so that a single sendmmsg() covers
+ * FANOUT_BATCH peers even though each one uses its own local port. The
+ * payload is shared by all of them.
+ */
+#define FANOUT_BATCH 64
+
+static int fanout_fd;
+
+static uint64_t fanout_sent;
+static uint64_t fanout_failed;
+static int fanout_last_errno;
+
+struct fanout_hdr {
+	struct iphdr iph;
+	struct udphdr udph;
+};
+
+struct fanout_batch {
+	const struct iovec *payload;
+	int payload_iovlen;
+	size_t payload_len;
+
+	unsigned int len;
+	struct mmsghdr msgs[FANOUT_BATCH];
+	struct iovec iov[FANOUT_BATCH][4];
+	struct fanout_hdr hdrs[FANOUT_BATCH];
+	struct sockaddr_in addrs[FANOUT_BATCH];
+};
+
+static void fanout_fail(int err)
+{
+	uatomic_inc(&fanout_failed);
+
+	if (uatomic_xchg(&fanout_last_errno, err) != err)
+		log_printf("Sending to remotes failed: %s\n", strerror(err));
+}
+
+static void fanout_flush(struct fanout_batch *batch)
+{
+	unsigned int i = 0;
+
+	while (i < batch->len) {
+		int ret = sendmmsg(fanout_fd, batch->msgs + i, batch->len - i, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Skip the message that failed, try the rest */
+			fanout_fail(errno);
+			i++;
+			continue;
+		}
+
+		uatomic_add(&fanout_sent, ret);
+		i += ret;
+	}
+
+	batch->len = 0;
+}
+
+static void fanout_add(struct fanout_batch *batch, const struct connection *conn,
+		       uint16_t remote_port)
+{
+	unsigned int i = batch->len++;
+
+	batch->hdrs[i] = (struct fanout_hdr) {
+		.iph = {
+			.ihl = 5,
+			.version = 4,
+			.tot_len = htons(sizeof(struct fanout_hdr) + batch->payload_len),
+			.frag_off = htons(IP_DF),
+			.ttl = 64,
+			.protocol = IPPROTO_UDP,
+			.saddr = public_host_ip,
+			.daddr = conn->remote.ip,
+		},
+		.udph = {
+			.uh_sport = htons(conn->local_port),
+			.uh_dport = htons(remote_port),
+			.uh_ulen = htons(sizeof(struct udphdr) + batch->payload_len),
+		},
+	};
+	batch->addrs[i] = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_addr = { conn->remote.ip },
+	};
+
+	batch->iov[i][0] = (struct iovec) {
+		.iov_base = &batch->hdrs[i],
+		.iov_len = sizeof(struct fanout_hdr),
+	};
+	memcpy(&batch->iov[i][1], batch->payload,
+	       sizeof(struct iovec) * batch->payload_iovlen);
+
+	batch->msgs[i] = (struct mmsghdr) {
+		.msg_hdr = {
+			.msg_name = &batch->addrs[i],
+			.msg_namelen = sizeof(struct sockaddr_in),
+			.msg_iov = batch->iov[i],
+			.msg_iovlen = 1 + batch->payload_iovlen,
+		},
+	};
+
+	if (batch->len == FANOUT_BATCH)
+		fanout_flush(batch);
+}
+
+static void fanout_all_remotes(const struct iovec *payload, int payload_iovlen)
+{
+	struct fanout_batch batch = {
+		.payload = payload,
+		.payload_iovlen = payload_iovlen,
+	};
+
+	assert(payload_iovlen < (int)ARRAY_SIZE(batch.iov[0]));
+	for (int i = 0; i < payload_iovlen; i++)
+		batch.payload_len += payload[i].iov_len;
+
+	struct userspace_connection *conn;
+	struct cds_lfht_iter iter;
+
+	rcu_read_lock();
+	cds_lfht_for_each_entry(ht_by_ip, &iter, conn, node) {
+		/* xdp_prog follows a peer to its new port in conns itself.
+		 * Our copy only catches up when the ring buffer record does,
+		 * and those may be dropped, so send to whatever conns has.
+		 */
+		uint16_t remote_port = conn->conn.remote.port;
+		const struct connection *live =
+			bpf_lookup_connection_by_ip(conn->conn.local_ip, NULL);
+		if (live)
+			remote_port = CMM_LOAD_SHARED(live->remote.port);
+
+		fanout_add(&batch, &conn->conn, remote_port);
+	}
+	rcu_read_unlock();
+
+	fanout_flush(&batch);
+}
+
+void remotes_fanout_stats(uint64_t *sent, uint64_t *failed)
+{
+	*sent = uatomic_read(&fanout_sent);
+	*failed = uatomic_read(&fanout_failed);
+}
+
 static void keepalive_thread_fn(void *arg)
 {
 	struct eventloop *el = eventloop_new();
@@ -50,22 +200,13 @@ static void keepalive_thread_fn(void *arg)
 	while (!thread_should_stop(current)) {
 		eventloop_enter(el, 2000);
 
-		char buf[] = "\xFF\xFEISHOAL KEEPALIVE";
-
-		struct userspace_connection *conn;
-		struct cds_lfht_iter iter;
+		static char buf[] = "\xFF\xFEISHOAL KEEPALIVE";
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = sizeof(buf),
+		};
 
-		rcu_read_lock();
-		cds_lfht_for_each_entry(ht_by_ip, &iter, conn, node) {
-			struct sockaddr_in addr = {
-				.sin_family = AF_INET,
-				.sin_port = htons(conn->conn.remote.port),
-				.sin_addr = { conn->conn.remote.ip },
-			};
-			sendto(conn->endpoint_fd, buf, sizeof(buf), 0,
-			       (struct sockaddr *)&addr, sizeof(addr));
-		}
-		rcu_read_unlock();
+		fanout_all_remotes(&iov, 1);
 	}
 
 	eventloop_destroy(el);
@@ -83,6 +224,10 @@ void start_endpoint(void)
 
 	setbuf(remotes_log, NULL);
 
+	fanout_fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (fanout_fd < 0)
+		crash_with_perror("socket(AF_INET, SOCK_RAW)");
+
 	seed = (uint32_t) time(NULL);
 
 	ht_by_ip = cds_lfht_new(1, 1, 0,
@@ -190,7 +335,12 @@ static void __add_connection(ipaddr_t local_ip, uint16_t local_port,
 		fprintf(remotes_log, "+ Remote IP %s, handled by port %d -> %s%d\n",
 			str, local_port, remote_ip == relay_ip ? "relay " : "",
 			remote_port);
-		bpf_add_connection(&conn->conn);
+		int ret = bpf_add_connection(&conn->conn);
+		if (ret) {
+			fprintf(remotes_log, "! Remote IP %s refused: %s\n",
+				str, strerror(-ret));
+			delete_connection(local_ip);
+		}
 	} else {
 		rcu_read_unlock();
 		pthread_mutex_unlock(&remotes_lock);
@@ -207,6 +357,8 @@ static void __add_connection(ipaddr_t local_ip, uint16_t local_port,
 			.endpoint_fd = endpoint_fd,
 			.rau = {
 				.ipaddr = local_ip,
+				.ifindex = switch_ifindex,
+				.if_mac = switch_side_mac,
 				.el = worker_el,
 				.cb = remotes_arp_cb,
 				.ctx = rpc_ctx,
@@ -324,23 +476,17 @@ out_unlock:
 
 void broadcast_all_remotes(const void *buf, size_t len)
 {
-	char buf_clone[sizeof(uint16_t) + len];
-
-	*(uint16_t *)buf_clone = 0xFFFF;
-	memcpy(buf_clone + sizeof(uint16_t), buf, len);
-
-	struct userspace_connection *conn;
-	struct cds_lfht_iter iter;
-
-	rcu_read_lock();
-	cds_lfht_for_each_entry(ht_by_ip, &iter, conn, node) {
-		struct sockaddr_in addr = {
-			.sin_family = AF_INET,
-			.sin_port = htons(conn->conn.remote.port),
-			.sin_addr = { conn->conn.remote.ip },
-		};
-		sendto(conn->endpoint_fd, buf_clone, sizeof(uint16_t) + len, 0,
-		       (struct sockaddr *)&addr, sizeof(addr));
-	}
-	rcu_read_unlock();
+	static uint16_t ishoal_ord = 0xFFFF;
+	struct iovec iov[] = {
+		{
+			.iov_base = &ishoal_ord,
+			.iov_len = sizeof(ishoal_ord),
+		},
+		{
+			.iov_base = (void *)buf,
+			.iov_len = len,
+		},
+	};
+
+	fanout_all_remotes(iov, ARRAY_SIZE(iov));
 }
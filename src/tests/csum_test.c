@@ -0,0 +1,187 @@
+#include "features.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The kernels are static; build them right into the test. */
+#include "../csum.c"
+
+#define MAX_LEN 4096
+#define MAX_ALIGN 64
+
+struct kernel {
+	const char *name;
+	unsigned int (*fn)(const unsigned char *buff, int len);
+	bool supported;
+};
+
+static struct kernel kernels[] = {
+	{ "scalar", do_csum_scalar, true },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", do_csum_sse2 },
+	{ "avx2", do_csum_avx2 },
+	{ "avx512", do_csum_avx512 },
+#endif
+};
+
+static unsigned char buf[MAX_ALIGN + MAX_LEN];
+
+static void fill_random(void)
+{
+	uint32_t x = 0x9e3779b9;
+
+	for (int i = 0; i < sizeof(buf); i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 24;
+	}
+}
+
+static void fill_ones(void)
+{
+	memset(buf, 0xff, sizeof(buf));
+}
+
+static void fill_alternating(void)
+{
+	for (int i = 0; i < sizeof(buf); i++)
+		buf[i] = i & 1 ? 0xff : 0x00;
+}
+
+static const struct {
+	const char *name;
+	void (*fill)(void);
+} fills[] = {
+	{ "random", fill_random },
+	{ "all-0xff", fill_ones },
+	{ "alternating", fill_alternating },
+};
+
+static void detect(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	kernels[1].supported = __builtin_cpu_supports("sse2");
+	kernels[2].supported = __builtin_cpu_supports("avx2");
+	kernels[3].supported = __builtin_cpu_supports("avx512f");
+#endif
+}
+
+/* Every kernel against do_csum_scalar, at every length up to MAX_LEN and
+ * every alignment within a cache line.
+ */
+static int check(void)
+{
+	int failed = 0;
+
+	for (int f = 0; f < ARRAY_SIZE(fills); f++) {
+		fills[f].fill();
+
+		for (int k = 1; k < ARRAY_SIZE(kernels); k++) {
+			if (!kernels[k].supported) {
+				printf("SKIP %s: not supported by this CPU\n",
+				       kernels[k].name);
+				continue;
+			}
+
+			int mismatches = 0;
+
+			for (int align = 0; align < MAX_ALIGN; align++)
+				for (int len = 0; len <= MAX_LEN; len++) {
+					unsigned int want, got;
+
+					want = do_csum_scalar(buf + align, len);
+					got = kernels[k].fn(buf + align, len);
+					if (want == got)
+						continue;
+
+					if (!mismatches++)
+						printf("FAIL %s %s: align %d len %d: "
+						       "got %#x, want %#x\n",
+						       kernels[k].name, fills[f].name,
+						       align, len, got, want);
+				}
+
+			if (mismatches)
+				failed++;
+			else
+				printf("PASS %s %s\n", kernels[k].name,
+				       fills[f].name);
+		}
+	}
+
+	return failed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Throughput over packet sized buffers, in GB/s */
+static void bench(void)
+{
+	static const int lens[] = { 64, 128, 256, 512, 1024, 1500 };
+	volatile unsigned int sink;
+
+	fill_random();
+
+	printf("%6s", "len");
+	for (int k = 0; k < ARRAY_SIZE(kernels); k++)
+		if (kernels[k].supported)
+			printf(" %8s", kernels[k].name);
+	printf("\n");
+
+	for (int l = 0; l < ARRAY_SIZE(lens); l++) {
+		int len = lens[l];
+		long iters = (1L << 30) / len;
+
+		printf("%6d", len);
+		for (int k = 0; k < ARRAY_SIZE(kernels); k++) {
+			if (!kernels[k].supported)
+				continue;
+
+			double start = now();
+			for (long i = 0; i < iters; i++)
+				sink = kernels[k].fn(buf + (i & 1), len);
+			double elapsed = now() - start;
+
+			printf(" %8.1f", (double)iters * len / elapsed / 1e9);
+		}
+		printf("\n");
+	}
+
+	(void)sink;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	bool do_bench = false;
+
+	while ((opt = getopt(argc, argv, "b")) != -1) {
+		switch (opt) {
+		case 'b':
+			do_bench = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	detect();
+
+	if (do_bench) {
+		bench();
+		return 0;
+	}
+
+	return check() ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 #include "features.h"
 
 #include <assert.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdlib.h>
@@ -126,6 +127,16 @@ bool thread_is_main(const struct thread *thread)
 	return thread == &main_thread;
 }
 
+int thread_set_cpu(const struct thread *thread, int cpu)
+{
+	cpu_set_t cpuset;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+
+	return pthread_setaffinity_np(thread->pthread, sizeof(cpuset), &cpuset);
+}
+
 int thread_signal(const struct thread *thread, int sig)
 {
 	return pthread_kill(thread->pthread, sig);
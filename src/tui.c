@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 
 #include "extern/plthook/plthook.h"
 
@@ -284,8 +285,7 @@ static void detect_switch_online(void)
 
 static void detect_local_switch(void)
 {
-	bpf_set_switch_ip(0);
-	bpf_set_switch_mac((macaddr_t){0});
+	bpf_set_switch(0, (macaddr_t){0});
 
 	dialog_vars.begin_set = false;
 	dialog_msgbox("Setup",
@@ -483,6 +483,8 @@ out:
 		eventloop_install_break(tui_el, ctx->done_eventfd);
 
 		ctx->rau.ipaddr = new_gateway_ip;
+		ctx->rau.ifindex = switch_ifindex;
+		ctx->rau.if_mac = switch_side_mac;
 		ctx->rau.el = tui_el;
 		ctx->rau.cb = rau_cb;
 		ctx->rau.ctx = ctx;
@@ -509,6 +511,99 @@ out:
 	}
 }
 
+struct peer_traffic_ctx {
+	char *buf;
+	size_t len, size;
+	uint64_t now_ns;
+};
+
+static void peer_traffic_line(const struct connection *conn,
+			      const struct conn_stats *stats, void *_ctx)
+{
+	struct peer_traffic_ctx *ctx = _ctx;
+	char ip[IP_STR_BULEN];
+	char seen[16];
+
+	if (ctx->len >= ctx->size)
+		return;
+
+	ip_str(conn->local_ip, ip);
+	if (stats->last_seen_ns)
+		snprintf(seen, sizeof(seen), "%llus",
+			 (unsigned long long)((ctx->now_ns - stats->last_seen_ns) /
+					      SECOND_NS));
+	else
+		snprintf(seen, sizeof(seen), "never");
+
+	int res = snprintf(ctx->buf + ctx->len, ctx->size - ctx->len,
+			   "%-15s %8llu/%-6lluK %8llu/%-6lluK %6llu %6s\n",
+			   ip,
+			   (unsigned long long)stats->rx_packets,
+			   (unsigned long long)(stats->rx_bytes / 1024),
+			   (unsigned long long)stats->tx_packets,
+			   (unsigned long long)(stats->tx_bytes / 1024),
+			   (unsigned long long)stats->drops,
+			   seen);
+	if (res > 0)
+		ctx->len += res;
+}
+
+/* Upper bound on one peer_traffic_line() or totals line */
+#define PEER_TRAFFIC_LINE 128
+
+static void peer_traffic_dialog(void)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		crash_with_perror("clock_gettime");
+
+	/* Totals and header, then one line per peer slot */
+	size_t size = (conn_entries + 8) * PEER_TRAFFIC_LINE;
+	char *buf = malloc(size);
+	if (!buf)
+		crash_with_perror("malloc");
+
+	struct peer_traffic_ctx ctx = {
+		.buf = buf,
+		.size = size,
+		.now_ns = (uint64_t) now.tv_sec * SECOND_NS + now.tv_nsec,
+	};
+
+	unsigned int peers_used, peers_max;
+	uint64_t peers_refused;
+	bpf_connection_capacity(&peers_used, &peers_max, &peers_refused);
+
+	uint64_t fanout_sent, fanout_failed;
+	remotes_fanout_stats(&fanout_sent, &fanout_failed);
+
+	uint64_t events[DP_EVENT_MAX];
+	dp_event_counts_read(events);
+
+	ctx.len = snprintf(buf, size,
+			   "Peer slots: %u of %u in use, %llu refused\n"
+			   "Broadcasts and keepalives: %llu sent, %llu failed\n"
+			   "NAT flows: %llu created, %llu expired, %llu refused\n"
+			   "Peer port changes: %llu, TTL exceeded: %llu\n\n"
+			   "%-15s %15s %15s %6s %6s\n",
+			   peers_used, peers_max,
+			   (unsigned long long)peers_refused,
+			   (unsigned long long)fanout_sent,
+			   (unsigned long long)fanout_failed,
+			   (unsigned long long)events[DP_EVENT_NAT_CREATE],
+			   (unsigned long long)events[DP_EVENT_NAT_EXPIRE],
+			   (unsigned long long)events[DP_EVENT_NAT_FULL],
+			   (unsigned long long)events[DP_EVENT_PORT_REMAP],
+			   (unsigned long long)events[DP_EVENT_TTL_EXCEEDED],
+			   "Peer", "Received", "Sent", "Drops", "Seen");
+	bpf_connection_stats_foreach(peer_traffic_line, &ctx);
+
+	dialog_vars.begin_set = false;
+	dialog_msgbox("Peer traffic", buf, 20, 76, 1);
+
+	free(buf);
+}
+
 static void switch_information_dialog(void)
 {
 	char ip[IP_STR_BULEN];
@@ -531,9 +626,19 @@ static void switch_information_dialog(void)
 	while (true) {
 		tui_clear();
 
+		dialog_vars.extra_button = true;
+		dialog_vars.extra_label = "Peers";
 		res = dialog_inputbox("Setup",
 				      "Please enter the MAC address of the Switch:\n",
 				      10, 40, mac, 0);
+		dialog_vars.extra_button = false;
+		dialog_vars.extra_label = NULL;
+		if (res == DLG_EXIT_EXTRA) {
+			snprintf(mac, MAC_STR_BULEN, "%s", dialog_vars.input_result);
+			peer_traffic_dialog();
+			dialog_vars.begin_set = false;
+			continue;
+		}
 		if (res)
 			return;
 
@@ -610,8 +715,7 @@ invalid_ip:
 	if (res)
 		return;
 
-	bpf_set_switch_ip(new_switch_ip);
-	bpf_set_switch_mac(new_switch_mac);
+	bpf_set_switch(new_switch_ip, new_switch_mac);
 
 	save_conf();
 }
@@ -11,34 +11,58 @@
 
 #include "ishoal.h"
 
-/* Ideally we should use AF_XDP, but decrypting xdpsock.user.c is too
- * much for mw. If you can, please send me a patch.
+/* Packets handled on an AF_XDP RX thread are queued onto that socket's TX
+ * ring and flushed once per RX batch (see xsk_tx()). The AF_PACKET socket
+ * is only a fallback for callers without an AF_XDP socket at hand. Either
+ * way they leave on the switch-facing interface, the only one the AF_XDP
+ * sockets are bound to. What the emulator sends to a separate uplink goes
+ * through tx_uplink() instead.
  */
 
 static int tx_sock;
+static int tx_uplink_sock;
+
+static int tx_sock_open(int sock_ifindex, const macaddr_t mac)
+{
+	int sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		crash_with_perror("socket(AF_PACKET, SOCK_RAW)");
+
+	struct sockaddr_ll addr_bind = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = 0,
+		.sll_ifindex = sock_ifindex,
+		.sll_hatype = htons(ARPHRD_ETHER),
+		.sll_pkttype = PACKET_HOST,
+		.sll_halen = sizeof(macaddr_t),
+	};
+	memcpy(addr_bind.sll_addr, mac, sizeof(macaddr_t));
+
+	if (bind(sock, (struct sockaddr *)&addr_bind, sizeof(addr_bind)))
+		crash_with_perror("bind");
+
+	return sock;
+}
 
 void tx(const void *pkt, size_t length)
 {
+	if (xsk_tx(pkt, length))
+		return;
+
 	static atomic_flag init_done = ATOMIC_FLAG_INIT;
-	if (!atomic_flag_test_and_set(&init_done)) {
-		tx_sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
-		if (tx_sock < 0)
-			crash_with_perror("socket(AF_PACKET, SOCK_RAW)");
-
-		struct sockaddr_ll addr_bind = {
-			.sll_family = AF_PACKET,
-			.sll_protocol = 0,
-			.sll_ifindex = ifindex,
-			.sll_hatype = htons(ARPHRD_ETHER),
-			.sll_pkttype = PACKET_HOST,
-			.sll_halen = sizeof(macaddr_t),
-		};
-		memcpy(addr_bind.sll_addr, host_mac, sizeof(macaddr_t));
-
-		if (bind(tx_sock, (struct sockaddr *)&addr_bind, sizeof(addr_bind)))
-			crash_with_perror("bind");
-	}
+	if (!atomic_flag_test_and_set(&init_done))
+		tx_sock = tx_sock_open(switch_ifindex, switch_side_mac);
 
 	if (send(tx_sock, pkt, length, 0) < 0)
 		crash_with_perror("send");
 }
+
+void tx_uplink(const void *pkt, size_t length)
+{
+	static atomic_flag init_done = ATOMIC_FLAG_INIT;
+	if (!atomic_flag_test_and_set(&init_done))
+		tx_uplink_sock = tx_sock_open(ifindex, host_mac);
+
+	if (send(tx_uplink_sock, pkt, length, 0) < 0)
+		crash_with_perror("send");
+}
@@ -10,6 +10,38 @@
 
 #include "ishoal.h"
 
+/* Data-plane diagnostics, kept apart from the peer log in remote.c */
+static FILE *diag_log;
+
+void log_init(void)
+{
+	// Best effort logging, like the error log in fork_tee.
+	int fd = open("/var/log/ishoal.log",
+		      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	diag_log = fdopen(fd, "a");
+	if (!diag_log) {
+		close(fd);
+		return;
+	}
+
+	setvbuf(diag_log, NULL, _IOLBF, 0);
+}
+
+void log_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!diag_log)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(diag_log, fmt, ap);
+	va_end(ap);
+}
+
 char *read_whole_file(const char *path, size_t *nbytes)
 {
 	FILE *f = fopen(path, "r");
@@ -10,46 +10,109 @@
 #include <linux/in.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/pkt_cls.h>
 #include <linux/udp.h>
 
 #include "xdpfilter.h"
 #include "pkt.h"
 
+/* NAPT, keyed both ways by the full 5-tuple, including ICMP echoes.
+ * Flows come and go on whatever CPU RSS picks, so give each CPU its own
+ * LRU list instead of contending on a shared one. Resized by userspace
+ * before loading.
+ */
 struct {
 	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, struct conntrack_key);
-	__type(value, struct track_entry);
-	__uint(max_entries, 1024);
-} conntrack_map SEC(".maps");
+	__uint(map_flags, BPF_F_NO_COMMON_LRU);
+	__type(key, struct napt_key);
+	__type(value, struct napt_entry);
+	__uint(max_entries, NAT_ENTRIES);
+} nat_out_map SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, struct icmp_echotrack_key);
-	__type(value, struct track_entry);
-	__uint(max_entries, 256);
-} icmp_echotrack_map SEC(".maps");
+	__uint(map_flags, BPF_F_NO_COMMON_LRU);
+	__type(key, struct napt_key);
+	__type(value, struct napt_entry);
+	__uint(max_entries, NAT_ENTRIES);
+} nat_in_map SEC(".maps");
 
+/* Connections live in conns, indexed by a slot allocated by userspace.
+ * conn_by_ip and conn_by_port only map to the slot. All of these, and the
+ * tracking maps, are resized by userspace before loading.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, char [8]);
-	__type(value, struct track_entry);
-	__uint(max_entries, 256);
-} icmp_echoerrtrack_map SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__type(key, uint32_t);
+	__type(value, struct connection);
+	__uint(max_entries, CONN_ENTRIES);
+} conns SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, ipaddr_t);
-	__type(value, struct connection);
-	__uint(max_entries, 256);
+	__type(value, uint32_t);
+	__uint(max_entries, CONN_ENTRIES);
 } conn_by_ip SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, uint16_t);
-	__type(value, struct connection);
-	__uint(max_entries, 256);
+	__type(value, uint32_t);
+	__uint(max_entries, CONN_ENTRIES);
 } conn_by_port SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct conn_stats);
+	__uint(max_entries, CONN_ENTRIES);
+} conn_stats_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct xdp_stat_entry);
+	__uint(max_entries, XDP_STAT_MAX);
+} stats_map SEC(".maps");
+
+/* Recent bpf_fib_lookup() results by destination, see fib_nexthop() */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__type(key, ipaddr_t);
+	__type(value, struct fib_nexthop);
+	__uint(max_entries, FIB_CACHE_ENTRIES);
+} fib_cache SEC(".maps");
+
+/* The switch-facing and uplink interfaces, by enum tx_port */
+struct {
+	__uint(type, BPF_MAP_TYPE_DEVMAP);
+	__uint(max_entries, TX_PORT_MAX);
+	__uint(key_size, sizeof(uint32_t));
+	__uint(value_size, sizeof(uint32_t));
+} tx_ports SEC(".maps");
+
+/* Filled by userspace with the xdp_route_* programs */
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, XDP_ROUTE_MAX);
+	__uint(key_size, sizeof(uint32_t));
+	__uint(value_size, sizeof(uint32_t));
+} xdp_routes SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct pkt_state);
+	__uint(max_entries, 1);
+} pkt_state_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, EVENTS_SIZE);
+} events SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_XSKMAP);
 	__uint(max_entries, MAX_XSKS);
@@ -57,17 +120,32 @@ struct {
 	__uint(value_size, sizeof(int));
 } xsks_map SEC(".maps");
 
-macaddr_t switch_mac;
-macaddr_t host_mac;
-macaddr_t gateway_mac;
+/* Double-buffered, config[config_gen & 1] is current */
+struct dp_config config[2];
+uint32_t config_gen;
+
+/* Fixed when loading, so the verifier can prune what a configuration
+ * never runs, such as the NAT routes without a fake gateway. Changing
+ * one means loading xdp_prog again, see xdp_reload() in xdpfilter.c.
+ */
+const volatile ipaddr_t public_host_ip = 0;
+const volatile ipaddr_t fake_gateway_ip = 0;
+
+const volatile ipaddr_t relay_ip = 0;
 
-ipaddr_t switch_ip;
-ipaddr_t public_host_ip;
-ipaddr_t fake_gateway_ip;
+const volatile ipaddr_t subnet_mask = 0;
 
-ipaddr_t relay_ip;
+const volatile bool rx_timestamp = false;
+const volatile bool tc_broadcast = false;
+/* bpf_fib_lookup() only answers with forwarding on the uplink */
+const volatile bool fib_enabled = false;
 
-ipaddr_t subnet_mask;
+/* Equal unless the switch has a NIC of its own */
+const volatile uint32_t switch_ifindex = 0;
+const volatile uint32_t uplink_ifindex = 0;
+
+/* max_entries of conns */
+const volatile uint32_t conn_entries = 0;
 
 char _license[] SEC("license") = "GPL";
 
@@ -76,5 +154,196 @@ char _license[] SEC("license") = "GPL";
 #endif
 
 int xdp_prog(struct xdp_md *ctx);
+int xdp_route_nat(struct xdp_md *ctx);
+int xdp_route_nat_return(struct xdp_md *ctx);
+int xdp_route_vpn_encap(struct xdp_md *ctx);
+int xdp_route_vpn_decap(struct xdp_md *ctx);
+int xdp_route_arp_proxy(struct xdp_md *ctx);
 
 #include "pkt.impl.h"
+
+struct broadcast_encap {
+	struct ethhdr eth;
+	struct iphdr iph;
+	struct udphdr udph;
+	uint16_t ishoal_ord;
+} __attribute__((packed));
+
+/* Peers tc_broadcast_fanout goes through per run. The verifier walks
+ * every iteration, including a fib_nexthop() each, so this, not
+ * conn_entries, bounds its work. The rest are handled by tail calling
+ * into itself.
+ */
+#define TC_BROADCAST_CHUNK 128
+
+/* Tail calls are limited to 33 in a row on the kernels we target */
+_Static_assert(MAX_CONNS / TC_BROADCAST_CHUNK <= 32,
+	       "tc_broadcast_fanout needs too many tail calls for MAX_CONNS");
+
+struct tc_broadcast_state {
+	struct broadcast_encap hdr;
+	/* The next peer slot to send to */
+	uint32_t slot;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, uint32_t);
+	__type(value, struct tc_broadcast_state);
+	__uint(max_entries, 1);
+} tc_broadcast_state_map SEC(".maps");
+
+/* Filled by userspace with tc_broadcast_fanout */
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, 1);
+	__uint(key_size, sizeof(uint32_t));
+	__uint(value_size, sizeof(uint32_t));
+} tc_broadcast_progs SEC(".maps");
+
+/* Replaces the VPN broadcast route when tc_broadcast is set. xdp_prog lets
+ * those frames up to here instead of sending them to userspace, and they
+ * are encapsulated once and cloned out to every peer by
+ * tc_broadcast_fanout, rewriting only the outer addresses in between.
+ */
+SEC("classifier")
+int tc_broadcast_prog(struct __sk_buff *skb)
+{
+	void *data = (void *)(long)skb->data;
+	void *data_end = (void *)(long)skb->data_end;
+
+	struct ethhdr *eth = data;
+	if ((void *)(eth + 1) > data_end)
+		return TC_ACT_OK;
+
+	struct dp_config cfg;
+	config_read(&cfg);
+
+	/* Same conditions as the VPN broadcast route in xdp_prog */
+	if (!(eth->h_dest[0] & 1) ||
+	    !mac_eq(cfg.switch_mac, eth->h_source) ||
+	    eth->h_proto != bpf_htons(ETH_P_IP))
+		return TC_ACT_OK;
+
+	struct iphdr *iph = (void *)(eth + 1);
+	if ((void *)(iph + 1) > data_end)
+		return TC_ACT_OK;
+
+	if (iph->protocol != IPPROTO_TCP &&
+	    iph->protocol != IPPROTO_UDP &&
+	    iph->protocol != IPPROTO_ICMP)
+		return TC_ACT_OK;
+
+	if (iph->protocol == IPPROTO_UDP) {
+		struct udphdr *udph = (void *)(iph + 1);
+		if ((void *)(udph + 1) > data_end)
+			return TC_ACT_OK;
+
+		// DHCP
+		if (udph->dest == bpf_htons(67) || udph->dest == bpf_htons(68))
+			return TC_ACT_OK;
+	}
+
+	uint32_t key = 0;
+	struct tc_broadcast_state *st =
+		bpf_map_lookup_elem(&tc_broadcast_state_map, &key);
+	if (!st)
+		return TC_ACT_OK;
+
+	uint32_t inner_len = skb->len - sizeof(struct ethhdr);
+	st->hdr = (struct broadcast_encap) {
+		.eth = {
+			.h_proto = bpf_htons(ETH_P_IP),
+		},
+		.iph = {
+			.ihl = 5,
+			.version = 4,
+			.tot_len = bpf_htons(sizeof(st->hdr) - sizeof(st->hdr.eth) +
+					     inner_len),
+			.id = iph->id,
+			.frag_off = bpf_htons(IP_DF),
+			.ttl = 64,
+			.protocol = IPPROTO_UDP,
+			.saddr = public_host_ip,
+		},
+		.udph = {
+			.len = bpf_htons(sizeof(st->hdr.udph) +
+					 sizeof(st->hdr.ishoal_ord) + inner_len),
+		},
+		.ishoal_ord = 0xFFFF,
+	};
+	if (bpf_skb_adjust_room(skb, sizeof(st->hdr) - sizeof(st->hdr.eth),
+				BPF_ADJ_ROOM_MAC,
+				BPF_F_ADJ_ROOM_ENCAP_L3_IPV4 |
+				BPF_F_ADJ_ROOM_ENCAP_L4_UDP))
+		return TC_ACT_SHOT;
+
+	st->slot = 0;
+	bpf_tail_call(skb, &tc_broadcast_progs, 0);
+
+	return TC_ACT_SHOT;
+}
+
+SEC("classifier")
+int tc_broadcast_fanout(struct __sk_buff *skb)
+{
+	uint32_t key = 0;
+	struct tc_broadcast_state *st =
+		bpf_map_lookup_elem(&tc_broadcast_state_map, &key);
+	if (!st)
+		return TC_ACT_SHOT;
+
+	struct dp_config cfg;
+	config_read(&cfg);
+
+	uint32_t first = st->slot;
+
+	for (uint32_t i = 0; i < TC_BROADCAST_CHUNK; i++) {
+		uint32_t slot = first + i;
+		if (slot >= conn_entries)
+			return TC_ACT_SHOT;
+
+		struct connection *conn = bpf_map_lookup_elem(&conns, &slot);
+
+		/* Freed slots have their local_ip cleared */
+		if (!conn || !conn->local_ip)
+			continue;
+
+		/* Peers may sit behind different routes, the relay among
+		 * them. fib_cache keeps this to a map lookup mostly.
+		 */
+		struct fib_nexthop nh;
+		fib_nexthop(skb, uplink_ifindex, &cfg, conn->remote.ip, &nh);
+		memcpy(st->hdr.eth.h_dest, nh.h_dest, sizeof(macaddr_t));
+		memcpy(st->hdr.eth.h_source, nh.h_source, sizeof(macaddr_t));
+
+		st->hdr.udph.source = bpf_htons(conn->local_port);
+		st->hdr.udph.dest = bpf_htons(conn->remote.port);
+
+		/* st->hdr.iph is not aligned */
+		struct iphdr outer_iph = st->hdr.iph;
+		outer_iph.daddr = conn->remote.ip;
+		recompute_iph_csum(&outer_iph);
+		st->hdr.iph = outer_iph;
+
+		if (bpf_skb_store_bytes(skb, 0, &st->hdr, sizeof(st->hdr), 0))
+			return TC_ACT_SHOT;
+
+		struct conn_stats *stats = pkt_conn_stats(slot);
+		if (bpf_clone_redirect(skb, nh.ifindex, 0)) {
+			if (stats)
+				stats->drops++;
+			continue;
+		}
+
+		if (stats) {
+			stats->tx_packets++;
+			stats->tx_bytes += skb->len;
+		}
+	}
+
+	st->slot = first + TC_BROADCAST_CHUNK;
+	bpf_tail_call(skb, &tc_broadcast_progs, 0);
+
+	return TC_ACT_SHOT;
+}
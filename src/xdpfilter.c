@@ -1,21 +1,44 @@
 #include "features.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <linux/if_packet.h>
+#include <linux/limits.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
+#include <urcu.h>
+#include <urcu/rculfhash.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <bpf/xsk.h>
 
 #include "ishoal.h"
+#include "jhash.h"
 #include "xdpfilter.skel.h"
 
 struct xdpfilter_bpf *obj;
 
+/* The loaded xdp_prog and its .rodata, which are obj's until the first
+ * xdp_reload(). obj keeps owning the maps and tc_broadcast_prog.
+ */
+static struct xdpfilter_bpf *xdp_obj;
+/* By enum tx_port, no uplink one if it is the switch-facing interface */
+static struct bpf_link *xdp_links[TX_PORT_MAX];
+struct xdpfilter_bpf__rodata *xdp_rodata;
+
+static pthread_mutex_t xdp_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes writers of the switch and of obj->bss->config */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
 macaddr_t switch_mac;
 ipaddr_t switch_ip;
 
@@ -47,12 +70,81 @@ static void switch_change_broadcast_init(void)
 
 static void close_obj(void)
 {
+	if (xdp_obj != obj)
+		xdpfilter_bpf__destroy(xdp_obj);
 	xdpfilter_bpf__destroy(obj);
 }
 
 static void detach_obj(void)
 {
-	bpf_set_link_xdp_fd(ifindex, -1, 0);
+	for (int port = 0; port < TX_PORT_MAX; port++)
+		if (xdp_links[port])
+			bpf_link__destroy(xdp_links[port]);
+}
+
+static struct bpf_tc_hook tc_hook;
+
+static void detach_tc(void)
+{
+	bpf_tc_hook_destroy(&tc_hook);
+}
+
+static void attach_tc(void)
+{
+	DECLARE_LIBBPF_OPTS(bpf_tc_hook, hook,
+		.ifindex = switch_ifindex,
+		.attach_point = BPF_TC_INGRESS,
+	);
+	DECLARE_LIBBPF_OPTS(bpf_tc_opts, opts,
+		.prog_fd = bpf_program__fd(obj->progs.tc_broadcast_prog),
+	);
+	int err;
+
+	tc_hook = hook;
+
+	err = bpf_tc_hook_create(&tc_hook);
+	if (err && err != -EEXIST) {
+		errno = -err;
+		crash_with_perror("bpf_tc_hook_create");
+	}
+
+	err = bpf_tc_attach(&tc_hook, &opts);
+	if (err) {
+		errno = -err;
+		crash_with_perror("bpf_tc_attach");
+	}
+	atexit(detach_tc);
+}
+
+/* bpf_fib_lookup() refuses to answer for an interface that does not
+ * forward, whatever the flags. That is the host's call to make, so only
+ * ask the FIB if the uplink already forwards; otherwise fib_nexthop()
+ * goes straight to gateway_mac, which gateway_refresh_start() keeps
+ * current.
+ */
+static bool fib_enabled;
+
+static void check_forwarding(void)
+{
+	char path[PATH_MAX];
+	char buf[8];
+
+	snprintf(path, PATH_MAX, "/proc/sys/net/ipv4/conf/%s/forwarding",
+		 iface);
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		log_printf("Failed to read %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (fgets(buf, sizeof(buf), f))
+		fib_enabled = atoi(buf);
+	fclose(f);
+
+	if (!fib_enabled)
+		log_printf("Forwarding is off on %s, next hops will use the "
+			   "default gateway\n", iface);
 }
 
 static void clear_map(void)
@@ -63,20 +155,409 @@ static void clear_map(void)
 	}
 }
 
-void bpf_add_connection(const struct connection *conn)
+/* Connections live in the BPF_F_MMAPABLE conns array, which we map here so
+ * that both the emulator and the bookkeeping below use plain loads and
+ * stores. conn_by_ip and conn_by_port only hold slot ids, and since they
+ * are only ever written from userspace we keep a copy of each so the
+ * emulator does not need a bpf() syscall to resolve one.
+ */
+struct conn_index {
+	struct cds_lfht_node node;
+	struct rcu_head rcu;
+	uint32_t key;
+	uint32_t slot;
+};
+
+static struct connection *conns;
+
+static uint32_t conn_index_seed;
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cds_lfht *conn_index_by_ip;
+static struct cds_lfht *conn_index_by_port;
+
+static uint32_t conn_slots_free[MAX_CONNS];
+static uint32_t conn_slots_nfree;
+
+/* Connections bpf_add_connection() had no room for */
+static uint64_t conns_refused;
+
+__attribute__((constructor))
+static void conn_index_init(void)
+{
+	conn_index_seed = (uint32_t) time(NULL);
+
+	conn_index_by_ip = cds_lfht_new(1, 1, 0,
+		CDS_LFHT_AUTO_RESIZE | CDS_LFHT_ACCOUNTING, NULL);
+	if (!conn_index_by_ip)
+		crash_with_perror("cds_lfht_new");
+
+	conn_index_by_port = cds_lfht_new(1, 1, 0,
+		CDS_LFHT_AUTO_RESIZE | CDS_LFHT_ACCOUNTING, NULL);
+	if (!conn_index_by_port)
+		crash_with_perror("cds_lfht_new");
+}
+
+/* Picks the map sizes left at zero and applies them, before loading.
+ * BPF_F_NO_COMMON_LRU splits max_entries among the CPUs, so the NAPT maps
+ * get a minimum per CPU.
+ */
+static void size_maps(void)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		errno = -ncpus;
+		crash_with_perror("libbpf_num_possible_cpus");
+	}
+
+	if (!conn_entries)
+		conn_entries = CONN_ENTRIES;
+	if (!nat_entries)
+		nat_entries = caa_max(NAT_ENTRIES, NAT_ENTRIES_PER_CPU * ncpus);
+
+	struct {
+		struct bpf_map *map;
+		int max_entries;
+	} sizes[] = {
+		{ obj->maps.conns, conn_entries },
+		{ obj->maps.conn_by_ip, conn_entries },
+		{ obj->maps.conn_by_port, conn_entries },
+		{ obj->maps.conn_stats_map, conn_entries },
+		{ obj->maps.nat_out_map, nat_entries },
+		{ obj->maps.nat_in_map, nat_entries },
+	};
+
+	for (int i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+		if (bpf_map__set_max_entries(sizes[i].map, sizes[i].max_entries))
+			crash_with_perror("bpf_map__set_max_entries");
+}
+
+static void conns_mmap(void)
+{
+	conns = mmap(NULL, sizeof(struct connection) * conn_entries,
+		     PROT_READ | PROT_WRITE, MAP_SHARED,
+		     bpf_map__fd(obj->maps.conns), 0);
+	if (conns == MAP_FAILED)
+		crash_with_perror("mmap");
+
+	for (int i = 0; i < conn_entries; i++)
+		conn_slots_free[conn_slots_nfree++] = conn_entries - 1 - i;
+}
+
+static int conn_index_match(struct cds_lfht_node *ht_node, const void *_key)
+{
+	struct conn_index *index =
+		caa_container_of(ht_node, struct conn_index, node);
+	const uint32_t *key = _key;
+
+	return *key == index->key;
+}
+
+static struct conn_index *conn_index_lookup(struct cds_lfht *ht, uint32_t key)
+{
+	struct cds_lfht_iter iter;
+	struct cds_lfht_node *ht_node;
+
+	cds_lfht_lookup(ht, jhash(&key, sizeof(key), conn_index_seed),
+			conn_index_match, &key, &iter);
+	ht_node = cds_lfht_iter_get_node(&iter);
+	if (!ht_node)
+		return NULL;
+
+	return caa_container_of(ht_node, struct conn_index, node);
+}
+
+static struct connection *conn_lookup(struct cds_lfht *ht, uint32_t key,
+				      uint32_t *slot)
+{
+	struct conn_index *index;
+	struct connection *conn = NULL;
+
+	rcu_read_lock();
+	index = conn_index_lookup(ht, key);
+	if (index) {
+		conn = &conns[index->slot];
+		if (slot)
+			*slot = index->slot;
+	}
+	rcu_read_unlock();
+
+	return conn;
+}
+
+struct connection *bpf_lookup_connection_by_ip(ipaddr_t local_ip, uint32_t *slot)
+{
+	return conn_lookup(conn_index_by_ip, local_ip, slot);
+}
+
+struct connection *bpf_lookup_connection_by_port(uint16_t local_port, uint32_t *slot)
+{
+	return conn_lookup(conn_index_by_port, local_port, slot);
+}
+
+struct connection *bpf_lookup_connection_by_slot(uint32_t slot)
+{
+	if (slot >= conn_entries)
+		return NULL;
+	return &conns[slot];
+}
+
+/* The per-peer counters are never reset, as the XDP program and the
+ * emulator threads own them. Instead, what a slot had accumulated when
+ * it was handed out is remembered here and subtracted when reading.
+ */
+static struct conn_stats conn_stats_base[MAX_CONNS];
+
+static void conn_stats_sum(uint32_t slot, struct conn_stats *stats)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		errno = -ncpus;
+		crash_with_perror("libbpf_num_possible_cpus");
+	}
+
+	struct conn_stats percpu[ncpus];
+
+	if (bpf_map_lookup_elem(bpf_map__fd(obj->maps.conn_stats_map),
+				&slot, percpu))
+		crash_with_perror("bpf_map_lookup_elem");
+
+	memset(stats, 0, sizeof(*stats));
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		stats->tx_packets += percpu[cpu].tx_packets;
+		stats->tx_bytes += percpu[cpu].tx_bytes;
+		stats->rx_packets += percpu[cpu].rx_packets;
+		stats->rx_bytes += percpu[cpu].rx_bytes;
+		stats->drops += percpu[cpu].drops;
+		stats->last_seen_ns = caa_max(stats->last_seen_ns,
+					      percpu[cpu].last_seen_ns);
+	}
+
+	xdpemu_conn_stats_read(slot, stats);
+}
+
+/* Must hold conns_lock */
+static void conn_stats_get(uint32_t slot, struct conn_stats *stats)
+{
+	const struct conn_stats *base = &conn_stats_base[slot];
+
+	conn_stats_sum(slot, stats);
+
+	stats->tx_packets -= base->tx_packets;
+	stats->tx_bytes -= base->tx_bytes;
+	stats->rx_packets -= base->rx_packets;
+	stats->rx_bytes -= base->rx_bytes;
+	stats->drops -= base->drops;
+	if (stats->last_seen_ns == base->last_seen_ns)
+		stats->last_seen_ns = 0;
+}
+
+int bpf_connection_stats(ipaddr_t local_ip, struct conn_stats *stats)
+{
+	struct conn_index *index;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&conns_lock);
+	rcu_read_lock();
+
+	index = conn_index_lookup(conn_index_by_ip, local_ip);
+	if (index) {
+		conn_stats_get(index->slot, stats);
+		ret = 0;
+	}
+
+	rcu_read_unlock();
+	pthread_mutex_unlock(&conns_lock);
+
+	return ret;
+}
+
+void bpf_connection_stats_foreach(
+	void (*fn)(const struct connection *conn,
+		   const struct conn_stats *stats, void *ctx),
+	void *ctx)
 {
+	struct conn_index *index;
+	struct cds_lfht_iter iter;
+
+	pthread_mutex_lock(&conns_lock);
+	rcu_read_lock();
+
+	cds_lfht_for_each_entry(conn_index_by_ip, &iter, index, node) {
+		struct connection conn = conns[index->slot];
+		struct conn_stats stats;
+
+		conn_stats_get(index->slot, &stats);
+		fn(&conn, &stats, ctx);
+	}
+
+	rcu_read_unlock();
+	pthread_mutex_unlock(&conns_lock);
+}
+
+/* Must hold conns_lock and the RCU read lock */
+static void conn_index_add(struct cds_lfht *ht, uint32_t key, uint32_t slot)
+{
+	struct conn_index *index = calloc(1, sizeof(*index));
+	if (!index)
+		crash_with_perror("calloc");
+
+	cds_lfht_node_init(&index->node);
+	index->key = key;
+	index->slot = slot;
+
+	struct cds_lfht_node *ht_node = cds_lfht_add_replace(ht,
+		jhash(&key, sizeof(key), conn_index_seed),
+		conn_index_match, &key, &index->node);
+	if (ht_node)
+		free_rcu(caa_container_of(ht_node, struct conn_index, node), rcu);
+}
+
+/* Must hold conns_lock and the RCU read lock */
+static void conn_index_del(struct cds_lfht *ht, struct conn_index *index)
+{
+	if (!cds_lfht_del(ht, &index->node))
+		free_rcu(index, rcu);
+}
+
+/* Returns 0, or a negative errno if the connection could not be added or
+ * updated, in which case the maps are left as they were. -ENOSPC means
+ * every slot is taken.
+ */
+int bpf_add_connection(const struct connection *conn)
+{
+	struct conn_index *index;
+	uint32_t slot;
+	int ret = 0;
+
+	pthread_mutex_lock(&conns_lock);
+	rcu_read_lock();
+
+	index = conn_index_lookup(conn_index_by_ip, conn->local_ip);
+	if (index) {
+		/* Existing connection, update in place */
+		struct connection *old = &conns[index->slot];
+		int fd = bpf_map__fd(obj->maps.conn_by_port);
+
+		if (old->local_port != conn->local_port) {
+			uint16_t old_port = old->local_port;
+
+			/* Make room first, conn_by_port may be full */
+			bpf_map_delete_elem(fd, &old_port);
+			if (bpf_map_update_elem(fd, &conn->local_port,
+						&index->slot, BPF_ANY)) {
+				ret = -errno;
+				bpf_map_update_elem(fd, &old_port, &index->slot,
+						    BPF_ANY);
+				goto refuse;
+			}
+
+			struct conn_index *port_index =
+				conn_index_lookup(conn_index_by_port, old_port);
+			if (port_index)
+				conn_index_del(conn_index_by_port, port_index);
+
+			CMM_STORE_SHARED(old->local_port, conn->local_port);
+			conn_index_add(conn_index_by_port, conn->local_port,
+				       index->slot);
+		}
+
+		CMM_STORE_SHARED(old->remote.ip, conn->remote.ip);
+		CMM_STORE_SHARED(old->remote.port, conn->remote.port);
+		goto out;
+	}
+
+	if (!conn_slots_nfree) {
+		ret = -ENOSPC;
+		goto refuse;
+	}
+	slot = conn_slots_free[conn_slots_nfree - 1];
+
+	conn_stats_sum(slot, &conn_stats_base[slot]);
+
+	/* Fill the slot before publishing it. A non-zero local_ip is also
+	 * what tc_broadcast_prog takes as the slot being live, so it goes
+	 * in last.
+	 */
+	conns[slot] = (struct connection) {
+		.local_port = conn->local_port,
+		.remote = conn->remote,
+	};
+	cmm_smp_wmb();
+	CMM_STORE_SHARED(conns[slot].local_ip, conn->local_ip);
+	cmm_smp_wmb();
+
 	if (bpf_map_update_elem(bpf_map__fd(obj->maps.conn_by_ip), &conn->local_ip,
-				conn, BPF_ANY))
-		crash_with_perror("bpf_map_update_elem");
+				&slot, BPF_ANY)) {
+		ret = -errno;
+		goto unfill;
+	}
 	if (bpf_map_update_elem(bpf_map__fd(obj->maps.conn_by_port), &conn->local_port,
-				conn, BPF_ANY))
-		crash_with_perror("bpf_map_update_elem");
+				&slot, BPF_ANY)) {
+		ret = -errno;
+		bpf_map_delete_elem(bpf_map__fd(obj->maps.conn_by_ip),
+				    &conn->local_ip);
+		goto unfill;
+	}
+
+	conn_slots_nfree--;
+
+	conn_index_add(conn_index_by_ip, conn->local_ip, slot);
+	conn_index_add(conn_index_by_port, conn->local_port, slot);
+	goto out;
+
+unfill:
+	CMM_STORE_SHARED(conns[slot].local_ip, 0);
+refuse:
+	conns_refused++;
+out:
+	rcu_read_unlock();
+	pthread_mutex_unlock(&conns_lock);
+
+	return ret;
+}
+
+void bpf_connection_capacity(unsigned int *used, unsigned int *max,
+			     uint64_t *refused)
+{
+	pthread_mutex_lock(&conns_lock);
+	*used = conn_entries - conn_slots_nfree;
+	*max = conn_entries;
+	*refused = conns_refused;
+	pthread_mutex_unlock(&conns_lock);
 }
 
 void bpf_delete_connection(ipaddr_t local_ip, uint16_t local_port)
 {
+	struct conn_index *index;
+
+	pthread_mutex_lock(&conns_lock);
+	rcu_read_lock();
+
 	bpf_map_delete_elem(bpf_map__fd(obj->maps.conn_by_ip), &local_ip);
 	bpf_map_delete_elem(bpf_map__fd(obj->maps.conn_by_port), &local_port);
+
+	index = conn_index_lookup(conn_index_by_port, local_port);
+	if (index)
+		conn_index_del(conn_index_by_port, index);
+
+	index = conn_index_lookup(conn_index_by_ip, local_ip);
+	if (index) {
+		/* The slot goes to the back of the free list, as an XDP program
+		 * or the emulator may still be looking at it.
+		 */
+		memmove(conn_slots_free + 1, conn_slots_free,
+			conn_slots_nfree * sizeof(*conn_slots_free));
+		conn_slots_free[0] = index->slot;
+		conn_slots_nfree++;
+
+		CMM_STORE_SHARED(conns[index->slot].local_ip, 0);
+
+		conn_index_del(conn_index_by_ip, index);
+	}
+
+	rcu_read_unlock();
+	pthread_mutex_unlock(&conns_lock);
 }
 
 static void __on_switch_change(void)
@@ -85,32 +566,173 @@ static void __on_switch_change(void)
 		crash_with_perror("eventfd_write");
 }
 
-void bpf_set_switch_ip(const ipaddr_t addr)
+/* Fill in the half of config[] readers are not on, then flip to it.
+ * A reader still copying the old half when it is next overwritten sees
+ * config_gen move and retries. Caller holds config_lock.
+ */
+static void config_publish(void)
 {
-	if (switch_ip == addr)
+	uint32_t gen = obj->bss->config_gen + 1;
+	struct dp_config *cfg = &obj->bss->config[gen & 1];
+
+	memcpy(cfg->switch_mac, switch_mac, sizeof(macaddr_t));
+	memcpy(cfg->host_mac, host_mac, sizeof(macaddr_t));
+	memcpy(cfg->gateway_mac, gateway_mac, sizeof(macaddr_t));
+	memcpy(cfg->switch_side_mac, switch_side_mac, sizeof(macaddr_t));
+	cfg->switch_ip = switch_ip;
+
+	cmm_smp_wmb();
+	CMM_STORE_SHARED(obj->bss->config_gen, gen);
+}
+
+static void __set_switch(const ipaddr_t addr, const macaddr_t mac)
+{
+	if (switch_ip == addr && !memcmp(switch_mac, mac, sizeof(macaddr_t)))
 		return;
 
 	switch_ip = addr;
-	obj->bss->switch_ip = addr;
+	memcpy(switch_mac, mac, sizeof(macaddr_t));
+	config_publish();
 	__on_switch_change();
 }
 
-void bpf_set_switch_mac(const macaddr_t addr)
+void bpf_set_switch(const ipaddr_t addr, const macaddr_t mac)
+{
+	pthread_mutex_lock(&config_lock);
+	__set_switch(addr, mac);
+	pthread_mutex_unlock(&config_lock);
+}
+
+void bpf_set_gateway_mac(const macaddr_t mac)
 {
-	if (!memcmp(switch_mac, addr, sizeof(macaddr_t)))
+	char str[MAC_STR_BULEN];
+
+	pthread_mutex_lock(&config_lock);
+	if (!memcmp(gateway_mac, mac, sizeof(macaddr_t))) {
+		pthread_mutex_unlock(&config_lock);
 		return;
+	}
 
-	memcpy(switch_mac, addr, sizeof(macaddr_t));
-	memcpy(obj->bss->switch_mac, addr, sizeof(macaddr_t));
-	__on_switch_change();
+	memcpy(gateway_mac, mac, sizeof(macaddr_t));
+	config_publish();
+	pthread_mutex_unlock(&config_lock);
+
+	mac_str(mac, str);
+	log_printf("Gateway is now at %s\n", str);
+}
+
+/* Detection only fills in a switch nobody has set in the meantime.
+ * Returns whether this call was the one that did.
+ */
+bool bpf_detect_switch(const ipaddr_t addr, const macaddr_t mac)
+{
+	bool detected = false;
+
+	pthread_mutex_lock(&config_lock);
+	if (!switch_ip) {
+		__set_switch(addr, mac);
+		detected = true;
+	}
+	pthread_mutex_unlock(&config_lock);
+
+	return detected;
 }
 
-static void update_subnet_mask(void)
+/* Must be called before loading */
+static void fill_rodata(struct xdpfilter_bpf__rodata *rodata)
 {
+	rodata->public_host_ip = public_host_ip;
+	rodata->fake_gateway_ip = fake_gateway_ip;
+	rodata->relay_ip = relay_ip;
+
 	if (fake_gateway_ip)
-		obj->bss->subnet_mask = htonl(0xFFFFFF00);
+		rodata->subnet_mask = htonl(0xFFFFFF00);
 	else
-		obj->bss->subnet_mask = real_subnet_mask;
+		rodata->subnet_mask = real_subnet_mask;
+
+	rodata->rx_timestamp = xsk_latency_stats;
+	rodata->tc_broadcast = tc_broadcast;
+	rodata->fib_enabled = fib_enabled;
+	rodata->conn_entries = conn_entries;
+
+	rodata->switch_ifindex = switch_ifindex;
+	rodata->uplink_ifindex = ifindex;
+}
+
+/* Point xdp_routes at o's route programs. Until xdp_prog is swapped
+ * too, a reload may briefly run the old parser into the new routes, both
+ * agreeing on pkt_state.
+ */
+static void install_routes(struct xdpfilter_bpf *o)
+{
+	struct bpf_program *routes[XDP_ROUTE_MAX] = {
+		[XDP_ROUTE_NAT] = o->progs.xdp_route_nat,
+		[XDP_ROUTE_NAT_RETURN] = o->progs.xdp_route_nat_return,
+		[XDP_ROUTE_VPN_ENCAP] = o->progs.xdp_route_vpn_encap,
+		[XDP_ROUTE_VPN_DECAP] = o->progs.xdp_route_vpn_decap,
+		[XDP_ROUTE_ARP_PROXY] = o->progs.xdp_route_arp_proxy,
+	};
+	int map_fd = bpf_map__fd(obj->maps.xdp_routes);
+
+	for (uint32_t route = 0; route < XDP_ROUTE_MAX; route++) {
+		int prog_fd = bpf_program__fd(routes[route]);
+
+		if (bpf_map_update_elem(map_fd, &route, &prog_fd, BPF_ANY))
+			crash_with_perror("bpf_map_update_elem");
+	}
+}
+
+/* Load xdp_prog again for the current settings, on top of obj's maps,
+ * and swap it in. Packets in flight finish on the old program.
+ */
+static void xdp_reload(void)
+{
+	struct xdpfilter_bpf *new_obj, *old_obj;
+	struct bpf_map *map;
+
+	pthread_mutex_lock(&xdp_reload_lock);
+
+	new_obj = xdpfilter_bpf__open();
+	if (!new_obj)
+		crash_with_perror("xdpfilter_bpf__open");
+
+	bpf_object__for_each_map(map, new_obj->obj) {
+		if (map == new_obj->maps.rodata)
+			continue;
+
+		struct bpf_map *shared = bpf_object__find_map_by_name(
+			obj->obj, bpf_map__name(map));
+		if (!shared || bpf_map__reuse_fd(map, bpf_map__fd(shared)))
+			crash_with_perror("bpf_map__reuse_fd");
+	}
+
+	bpf_program__set_autoload(new_obj->progs.tc_broadcast_prog, false);
+	bpf_program__set_autoload(new_obj->progs.tc_broadcast_fanout, false);
+	fill_rodata(new_obj->rodata);
+
+	int err = xdpfilter_bpf__load(new_obj);
+	if (err) {
+		errno = -err;
+		crash_with_perror("xdpfilter_bpf__load");
+	}
+
+	install_routes(new_obj);
+	for (int port = 0; port < TX_PORT_MAX; port++)
+		if (xdp_links[port] &&
+		    bpf_link__update_program(xdp_links[port],
+					     new_obj->progs.xdp_prog))
+			crash_with_perror("bpf_link__update_program");
+
+	old_obj = xdp_obj;
+	xdp_obj = new_obj;
+	rcu_assign_pointer(xdp_rodata, new_obj->rodata);
+
+	/* The emulator may still be running on the old .rodata */
+	synchronize_rcu();
+	if (old_obj != obj)
+		xdpfilter_bpf__destroy(old_obj);
+
+	pthread_mutex_unlock(&xdp_reload_lock);
 }
 
 void bpf_set_fake_gateway_ip(const ipaddr_t addr)
@@ -119,25 +741,210 @@ void bpf_set_fake_gateway_ip(const ipaddr_t addr)
 		return;
 
 	fake_gateway_ip = addr;
-	obj->bss->fake_gateway_ip = addr;
+	xdp_reload();
+}
+
+static const char *const xdp_stat_names[XDP_STAT_MAX] = {
+	[XDP_STAT_PASS] = "pass",
+	[XDP_STAT_PASS_UNTRACKED] = "pass_untracked",
+	[XDP_STAT_NAT_ROUTE] = "nat_route",
+	[XDP_STAT_NAT_RETURN] = "nat_return",
+	[XDP_STAT_VPN_ENCAP] = "vpn_encap",
+	[XDP_STAT_VPN_DECAP] = "vpn_decap",
+	[XDP_STAT_VPN_BROADCAST] = "vpn_broadcast",
+	[XDP_STAT_ARP_PROXY] = "arp_proxy",
+	[XDP_STAT_TTL_EXCEEDED] = "ttl_exceeded",
+	[XDP_STAT_TO_USERSPACE] = "to_userspace",
+	[XDP_STAT_DROP_MALFORMED] = "drop_malformed",
+	[XDP_STAT_DROP_ADJUST] = "drop_adjust",
+	[XDP_STAT_DROP_BAD_ORD] = "drop_bad_ord",
+	[XDP_STAT_DROP_RELAY_PORT] = "drop_relay_port",
+	[XDP_STAT_DROP_BAD_INNER] = "drop_bad_inner",
+	[XDP_STAT_DROP_NAT_PORT] = "drop_nat_port",
+	[XDP_STAT_PASS_NO_ROUTE] = "pass_no_route",
+};
+
+const char *xdp_stat_name(enum xdp_stat stat)
+{
+	return xdp_stat_names[stat];
+}
+
+/* Sums the XDP program's per-CPU counters and the emulator's per-thread
+ * ones. Packets sent to userspace are counted once as to_userspace by
+ * the XDP program, and again under the route the emulator takes.
+ */
+void xdp_stats_read(struct xdp_stat_entry stats[XDP_STAT_MAX])
+{
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		errno = -ncpus;
+		crash_with_perror("libbpf_num_possible_cpus");
+	}
+
+	struct xdp_stat_entry percpu[ncpus];
+
+	memset(stats, 0, sizeof(*stats) * XDP_STAT_MAX);
 
-	update_subnet_mask();
+	for (uint32_t stat = 0; stat < XDP_STAT_MAX; stat++) {
+		if (bpf_map_lookup_elem(bpf_map__fd(obj->maps.stats_map),
+					&stat, percpu))
+			crash_with_perror("bpf_map_lookup_elem");
+
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			stats[stat].packets += percpu[cpu].packets;
+			stats[stat].bytes += percpu[cpu].bytes;
+		}
+	}
+
+	xdpemu_stats_read(stats);
 }
 
-static void on_xsk_pkt(void *ptr, size_t length)
+/* Listeners only care that traffic is flowing, so the first packet is
+ * signalled right away and the rest at most XSK_PKT_NOTIFY_HZ times a
+ * second, across all RX threads.
+ */
+#define XSK_PKT_NOTIFY_HZ 4
+
+static uint64_t xsk_pkt_notified_ns;
+
+static uint64_t dp_event_counts[DP_EVENT_MAX];
+
+/* From the events ring buffer, or straight from the emulator */
+void dp_event_handle(const struct dp_event *event)
 {
-	if (obj->bss->switch_ip != switch_ip ||
-	    memcmp(obj->bss->switch_mac, switch_mac, sizeof(macaddr_t))) {
-		switch_ip = obj->bss->switch_ip;
-		memcpy(switch_mac, obj->bss->switch_mac, sizeof(macaddr_t));
+	if (event->type >= DP_EVENT_MAX)
+		return;
 
-		__on_switch_change();
+	switch (event->type) {
+	case DP_EVENT_SWITCH_DETECTED:
+		/* Every discovery broadcast reports it until the new config
+		 * is published, and the emulator may see the same packet
+		 * again. Only count the one that took.
+		 */
+		if (!bpf_detect_switch(event->sw.ip, event->sw.mac))
+			return;
+		break;
+	case DP_EVENT_PORT_REMAP:
+		update_connection_remote_port(event->remap.local_ip,
+					      event->remap.new_port);
+		break;
 	}
 
+	uatomic_inc(&dp_event_counts[event->type]);
+}
+
+void dp_event_counts_read(uint64_t counts[DP_EVENT_MAX])
+{
+	for (int type = 0; type < DP_EVENT_MAX; type++)
+		counts[type] = uatomic_read(&dp_event_counts[type]);
+}
+
+static struct ring_buffer *events_rb;
+
+static int events_sample_cb(void *ctx, void *data, size_t size)
+{
+	if (size >= sizeof(struct dp_event))
+		dp_event_handle(data);
+	return 0;
+}
+
+static void events_cb(int fd, void *ctx, bool expired)
+{
+	if (ring_buffer__consume(events_rb) < 0)
+		crash_with_perror("ring_buffer__consume");
+}
+
+static void events_start(void)
+{
+	events_rb = ring_buffer__new(bpf_map__fd(obj->maps.events),
+				     events_sample_cb, NULL, NULL);
+	if (libbpf_get_error(events_rb))
+		crash_with_perror("ring_buffer__new");
+
+	worker_install_event(&(struct event){
+		.fd = ring_buffer__epoll_fd(events_rb),
+		.eventfd_ack = false,
+		.handler_type = EVT_CALL_FN,
+		.handler_fn = events_cb,
+	});
+}
+
+static void xsk_pkt_notify(void)
+{
+	uint64_t last = uatomic_read(&xsk_pkt_notified_ns);
+	struct timespec ts;
+	uint64_t now;
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
+		return;
+	now = (uint64_t) ts.tv_sec * SECOND_NS + ts.tv_nsec;
+
+	if (last && now - last < SECOND_NS / XSK_PKT_NOTIFY_HZ)
+		return;
+	if (uatomic_cmpxchg(&xsk_pkt_notified_ns, last, now) != last)
+		return;
+
 	if (eventfd_write(xsk_broadcast_evt_broadcast_primary, 1))
 		crash_with_perror("eventfd_write");
+}
+
+static void on_xsk_pkt(struct pkt_buf *bufs, unsigned int n)
+{
+	xdpemu_batch(bufs, n);
+	xsk_pkt_notify();
+}
+
+/* With tc_broadcast, broadcasts from the switch never make it to AF_XDP,
+ * so watch xdp_prog count them instead.
+ */
+static void broadcast_watch_cb(int fd, void *ctx, bool expired)
+{
+	static uint64_t last;
+	uint32_t stat = XDP_STAT_VPN_BROADCAST;
+	uint64_t expirations;
+	uint64_t packets = 0;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		crash_with_perror("read(timerfd)");
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0) {
+		errno = -ncpus;
+		crash_with_perror("libbpf_num_possible_cpus");
+	}
+
+	struct xdp_stat_entry percpu[ncpus];
+
+	if (bpf_map_lookup_elem(bpf_map__fd(obj->maps.stats_map), &stat, percpu))
+		crash_with_perror("bpf_map_lookup_elem");
+
+	for (int cpu = 0; cpu < ncpus; cpu++)
+		packets += percpu[cpu].packets;
+
+	if (packets != last)
+		xsk_pkt_notify();
+	last = packets;
+}
+
+static void broadcast_watch_start(void)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		crash_with_perror("timerfd_create");
+
+	struct itimerspec its = {
+		.it_interval = { .tv_nsec = SECOND_NS / XSK_PKT_NOTIFY_HZ },
+		.it_value = { .tv_nsec = SECOND_NS / XSK_PKT_NOTIFY_HZ },
+	};
+	if (timerfd_settime(fd, 0, &its, NULL))
+		crash_with_perror("timerfd_settime");
 
-	xdpemu(ptr, length);
+	worker_install_event(&(struct event){
+		.fd = fd,
+		.eventfd_ack = false,
+		.handler_type = EVT_CALL_FN,
+		.handler_fn = broadcast_watch_cb,
+	});
 }
 
 void bpf_load_thread_fn(void *arg)
@@ -152,37 +959,83 @@ void bpf_load_thread_fn(void *arg)
 		crash_with_perror("socket(AF_PACKET, SOCK_RAW)");
 
 	struct packet_mreq mreq = {
-		.mr_ifindex = ifindex,
+		.mr_ifindex = switch_ifindex,
 		.mr_type = PACKET_MR_PROMISC,
 	};
 	if (setsockopt(promisc_sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
 		       &mreq, sizeof(mreq)))
 		crash_with_perror("setsockopt");
 
-	obj = xdpfilter_bpf__open_and_load();
+	obj = xdpfilter_bpf__open();
 	if (!obj)
-		exit(1);
+		crash_with_perror("xdpfilter_bpf__open");
+
+	size_maps();
+	check_forwarding();
+	fill_rodata(obj->rodata);
 
+	int err = xdpfilter_bpf__load(obj);
+	if (err) {
+		errno = -err;
+		crash_with_perror("xdpfilter_bpf__load");
+	}
+
+	xdp_obj = obj;
+	xdp_rodata = obj->rodata;
 	atexit(close_obj);
 
-	obj->bss->switch_ip = switch_ip;
-	memcpy(obj->bss->switch_mac, switch_mac, sizeof(macaddr_t));
+	conns_mmap();
+	events_start();
+	install_routes(obj);
 
-	obj->bss->public_host_ip = public_host_ip;
-	memcpy(obj->bss->host_mac, host_mac, sizeof(macaddr_t));
-	memcpy(obj->bss->gateway_mac, gateway_mac, sizeof(macaddr_t));
+	pthread_mutex_lock(&config_lock);
+	config_publish();
+	pthread_mutex_unlock(&config_lock);
+	gateway_refresh_start();
 
-	obj->bss->fake_gateway_ip = fake_gateway_ip;
-	update_subnet_mask();
+	/* xdp_prog leaves broadcasts to tc_broadcast_prog, which has to be
+	 * there first.
+	 */
+	if (tc_broadcast) {
+		uint32_t key = 0;
+		int prog_fd = bpf_program__fd(obj->progs.tc_broadcast_fanout);
+
+		if (bpf_map_update_elem(bpf_map__fd(obj->maps.tc_broadcast_progs),
+					&key, &prog_fd, BPF_ANY))
+			crash_with_perror("bpf_map_update_elem");
 
-	obj->bss->relay_ip = relay_ip;
+		attach_tc();
+		broadcast_watch_start();
+	}
 
-	if (bpf_set_link_xdp_fd(ifindex, bpf_program__fd(obj->progs.xdp_prog), 0) < 0)
-		crash_with_perror("bpf_set_link_xdp_fd");
+	/* xdp_prog runs on both sides, also so that either can take frames
+	 * redirected from the other.
+	 */
+	uint32_t tx_ports[TX_PORT_MAX] = {
+		[TX_PORT_SWITCH] = switch_ifindex,
+		[TX_PORT_UPLINK] = ifindex,
+	};
 	atexit(detach_obj);
 
+	for (uint32_t port = 0; port < TX_PORT_MAX; port++) {
+		if (bpf_map_update_elem(bpf_map__fd(obj->maps.tx_ports), &port,
+					&tx_ports[port], 0))
+			crash_with_perror("bpf_map_update_elem");
+
+		if (port == TX_PORT_UPLINK && ifindex == switch_ifindex)
+			break;
+
+		xdp_links[port] = bpf_program__attach_xdp(obj->progs.xdp_prog,
+							  tx_ports[port]);
+		if (libbpf_get_error(xdp_links[port])) {
+			xdp_links[port] = NULL;
+			crash_with_perror("bpf_program__attach_xdp");
+		}
+	}
+
+	/* Only the switch side has anything for userspace */
 	for (int i = 0; i < MAX_XSKS; i++) {
-		struct xsk_socket *xsk = xsk_configure_socket(iface, i, on_xsk_pkt);
+		struct xsk_socket *xsk = xsk_configure_socket(switch_iface, i, on_xsk_pkt);
 		if (!xsk) {
 			if (i)
 				break;
@@ -9,9 +9,157 @@ typedef unsigned char macaddr_t[ETH_ALEN];
 typedef uint32_t ipaddr_t;
 
 #define MAX_XSKS 64
+/* Upper bound of -C, which sizes the per-slot arrays in userspace and
+ * the chain of tail calls in tc_broadcast_fanout.
+ */
+#define MAX_CONNS 4096
+/* Upper bound of -N, both NAPT maps are preallocated at this size */
+#define MAX_NAT_ENTRIES 262144
+
+/* Default map sizes. See size_maps() in xdpfilter.c. */
+#define CONN_ENTRIES 1024
+#define NAT_ENTRIES 4096
+#define NAT_ENTRIES_PER_CPU 256
+#define FIB_CACHE_ENTRIES 256
+
+/* Bytes, a power of 2 multiple of the page size */
+#define EVENTS_SIZE (64 * 1024)
 
 #define SECOND_NS 1000000000ULL
 
+/* How long a bpf_fib_lookup() result is reused for */
+#define FIB_CACHE_NS SECOND_NS
+
+/* Data-plane settings that change at runtime. Userspace fills the half
+ * of config[] not in use and then bumps config_gen, see config_publish()
+ * in xdpfilter.c and config_read() in pkt.impl.h.
+ */
+struct dp_config {
+	macaddr_t switch_mac;
+	macaddr_t host_mac;
+	macaddr_t gateway_mac;
+	/* host_mac on the switch-facing interface */
+	macaddr_t switch_side_mac;
+	ipaddr_t switch_ip;
+};
+
+/* Prepended as XDP metadata to packets redirected to AF_XDP when
+ * rx_timestamp is set, so userspace can measure its wakeup latency.
+ */
+#define XSK_RX_META_MAGIC 0x15A0A1EAF7ULL
+
+struct xsk_rx_meta {
+	uint64_t magic;
+	uint64_t ktime_ns;
+};
+
+/* Where packets went in xdp_prog, counted per CPU (per RX thread in
+ * the emulator). Keep xdp_stat_names in xdpfilter.c in sync.
+ */
+enum xdp_stat {
+	XDP_STAT_PASS,
+	XDP_STAT_PASS_UNTRACKED,
+	XDP_STAT_NAT_ROUTE,
+	XDP_STAT_NAT_RETURN,
+	XDP_STAT_VPN_ENCAP,
+	XDP_STAT_VPN_DECAP,
+	XDP_STAT_VPN_BROADCAST,
+	XDP_STAT_ARP_PROXY,
+	XDP_STAT_TTL_EXCEEDED,
+	XDP_STAT_TO_USERSPACE,
+	XDP_STAT_DROP_MALFORMED,
+	XDP_STAT_DROP_ADJUST,
+	XDP_STAT_DROP_BAD_ORD,
+	XDP_STAT_DROP_RELAY_PORT,
+	XDP_STAT_DROP_BAD_INNER,
+	XDP_STAT_DROP_NAT_PORT,
+	XDP_STAT_PASS_NO_ROUTE,
+	XDP_STAT_MAX,
+};
+
+/* Slots of the tx_ports devmap */
+enum tx_port {
+	TX_PORT_SWITCH,
+	TX_PORT_UPLINK,
+	TX_PORT_MAX,
+};
+
+/* Stages xdp_prog hands packets to, slots of the xdp_routes prog array */
+enum xdp_route {
+	XDP_ROUTE_NAT,
+	XDP_ROUTE_NAT_RETURN,
+	XDP_ROUTE_VPN_ENCAP,
+	XDP_ROUTE_VPN_DECAP,
+	XDP_ROUTE_ARP_PROXY,
+	XDP_ROUTE_MAX,
+};
+
+struct xdp_stat_entry {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+/* Per peer, indexed by connection slot. Encapsulated traffic to the peer
+ * is tx, decapsulated traffic from it rx; drops are packets dropped
+ * after being matched to the peer.
+ */
+struct conn_stats {
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t drops;
+	uint64_t last_seen_ns;
+};
+
+enum dp_event_type {
+	DP_EVENT_SWITCH_DETECTED,
+	DP_EVENT_PORT_REMAP,
+	DP_EVENT_NAT_CREATE,
+	DP_EVENT_NAT_EXPIRE,
+	DP_EVENT_NAT_FULL,
+	DP_EVENT_TTL_EXCEEDED,
+	DP_EVENT_MAX,
+};
+
+/* Records in the events ring buffer, from the data plane to userspace */
+struct dp_event {
+	uint32_t type;
+	union {
+		/* Seen broadcasting while no switch was set */
+		struct {
+			ipaddr_t ip;
+			macaddr_t mac;
+		} sw;
+		/* The peer now sends from new_port, which xdp_prog has
+		 * already stored into its conns entry.
+		 */
+		struct {
+			ipaddr_t local_ip;
+			uint16_t old_port;
+			uint16_t new_port;
+		} remap;
+		/* A NAT flow as the switch side sends it, ports in network
+		 * order. Created with nat_port, found expired on the way
+		 * back, or refused for want of a free port. LRU evictions
+		 * are not reported.
+		 */
+		struct {
+			ipaddr_t saddr;
+			ipaddr_t daddr;
+			uint16_t sport;
+			uint16_t dport;
+			uint16_t nat_port;
+			uint8_t protocol;
+		} nat;
+		/* Of the packet whose TTL ran out */
+		struct {
+			ipaddr_t saddr;
+			ipaddr_t daddr;
+		} ttl;
+	};
+};
+
 struct remote_addr {
 	ipaddr_t ip;
 	uint16_t port;
@@ -23,4 +171,10 @@ struct connection {
 	struct remote_addr remote;
 };
 
+/* conns is mmap()ed into userspace, where it is accessed as a plain array.
+ * The kernel lays out array map values 8-byte aligned.
+ */
+_Static_assert(sizeof(struct connection) % 8 == 0,
+	      "struct connection must be a multiple of 8 bytes");
+
 #endif
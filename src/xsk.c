@@ -2,15 +2,21 @@
 
 #include <assert.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <link.h>
 #include <linux/limits.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdatomic.h>
 #include <string.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <urcu.h>
 
 #include <bpf/xsk.h>
 
@@ -62,7 +68,34 @@ static void monkey_patch(void)
  * And lots of trial and error. Not much idea how it works.
  */
 
-#define NUM_FRAMES 256
+#define NUM_RX_FRAMES 256
+#define NUM_TX_FRAMES 256
+#define NUM_FRAMES (NUM_RX_FRAMES + NUM_TX_FRAMES)
+#define RX_BATCH_SIZE 64
+
+#define FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+
+/* Extra room in front of every received packet, on top of
+ * XDP_PACKET_HEADROOM, which the XDP metadata already eats into. The
+ * emulator grows encapsulated packets into it instead of copying them.
+ */
+#define FRAME_HEADROOM 64
+
+/* In busy-poll mode, go back to sleeping in poll() once the queue has been
+ * empty for this long.
+ */
+#define BUSY_POLL_IDLE_NS (10 * 1000 * 1000ULL)
+
+/* Not in every libc's headers yet */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+#define LATENCY_BUCKETS 32
+#define LATENCY_LOG_INTERVAL_S 60
 
 struct xsk_umem_info {
 	struct xsk_ring_prod fq;
@@ -73,10 +106,43 @@ struct xsk_umem_info {
 
 struct xsk_socket_info {
 	struct xsk_ring_cons rx;
+	struct xsk_ring_prod tx;
 	struct xsk_umem_info umem;
 	struct xsk_socket *xsk;
 
-	void (*handler)(void * restrict pkt, size_t length);
+	/* Free stack of UMEM frames owned by userspace. The fill ring is
+	 * topped up from it to NUM_RX_FRAMES, the rest is what tx() copies
+	 * foreign packets into. A received frame that is sent back out in
+	 * place only returns here once the completion ring reports it.
+	 */
+	uint64_t frames[NUM_FRAMES];
+	uint32_t frames_free;
+	uint32_t fq_outstanding;
+	uint32_t tx_pending;
+
+	/* Frames of the RX batch being handled that tx() has not taken
+	 * over yet, indexed by frame number.
+	 */
+	bool rx_held[NUM_FRAMES];
+
+	/* Bound with XDP_USE_NEED_WAKEUP: only kick the kernel when it
+	 * asks for it through the ring flags.
+	 */
+	bool need_wakeup;
+	bool zerocopy;
+
+	/* Every queue is serviced by its own thread, pinned to the CPU
+	 * that handles the queue's interrupt.
+	 */
+	int queue;
+	int cpu;
+	struct eventloop *el;
+	struct thread *thread;
+
+	/* log2(ns) buckets of XDP-to-userspace latency, see xsk_rx_meta */
+	uint64_t latency_hist[LATENCY_BUCKETS];
+
+	void (*handler)(struct pkt_buf *bufs, unsigned int n);
 };
 
 static pthread_mutex_t xsks_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -90,44 +156,568 @@ static void del_socket(void)
 	}
 }
 
-static void rx_cb(int fd, void *ctx, bool expired)
+/* The socket whose RX batch is currently being handled on this thread. */
+static __thread struct xsk_socket_info *xsk_current;
+
+static void tx_complete(struct xsk_socket_info *xsk)
 {
-	unsigned int rcvd, i;
-	struct xsk_socket_info *xsk = ctx;
-	uint32_t idx_rx = 0, idx_fq = 0;
-	int ret;
+	uint32_t idx_cq = 0;
+	unsigned int done, i;
 
-	assert(xsk_socket__fd(xsk->xsk) == fd);
+	done = xsk_ring_cons__peek(&xsk->umem.cq, NUM_FRAMES, &idx_cq);
+	if (!done)
+		return;
+
+	for (i = 0; i < done; i++)
+		xsk->frames[xsk->frames_free++] = xsk_umem__extract_addr(
+			*xsk_ring_cons__comp_addr(&xsk->umem.cq, idx_cq++)) &
+			~(uint64_t)(FRAME_SIZE - 1);
+
+	xsk_ring_cons__release(&xsk->umem.cq, done);
+}
+
+/* A kick that fails, say with ENXIO while the link flaps, is retried on
+ * the next flush anyway, so only keep track of it.
+ */
+static uint64_t xsk_kicks_failed;
+static int xsk_kick_last_errno;
+
+static void kick_fail(struct xsk_socket_info *xsk, const char *what, int err)
+{
+	uint64_t failed = uatomic_add_return(&xsk_kicks_failed, 1);
+
+	if (uatomic_xchg(&xsk_kick_last_errno, err) != err)
+		log_printf("AF_XDP queue %d: %s failed: %s "
+			   "(%" PRIu64 " kicks failed so far)\n",
+			   xsk->queue, what, strerror(err), failed);
+}
+
+static void tx_kick(struct xsk_socket_info *xsk)
+{
+	if (sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0)
+		return;
 
-	rcvd = xsk_ring_cons__peek(&xsk->rx, 64, &idx_rx);
-	if (!rcvd)
+	/* The TX ring is drained asynchronously; these only mean the
+	 * kernel could not take everything right now.
+	 */
+	if (errno == EAGAIN || errno == EBUSY || errno == ENOBUFS ||
+	    errno == ENETDOWN)
 		return;
 
-	ret = xsk_ring_prod__reserve(&xsk->umem.fq, rcvd, &idx_fq);
-	while (ret != rcvd)
-		ret = xsk_ring_prod__reserve(&xsk->umem.fq, rcvd, &idx_fq);
+	kick_fail(xsk, "TX wakeup", errno);
+}
+
+static void tx_flush(struct xsk_socket_info *xsk)
+{
+	if (!xsk->tx_pending)
+		return;
+
+	xsk_ring_prod__submit(&xsk->tx, xsk->tx_pending);
+	xsk->tx_pending = 0;
+
+	if (busy_poll_budget || !xsk->need_wakeup ||
+	    xsk_ring_prod__needs_wakeup(&xsk->tx))
+		tx_kick(xsk);
+	tx_complete(xsk);
+}
+
+static void fq_kick(struct xsk_socket_info *xsk)
+{
+	/* In busy-poll mode the syscall is what drives the NAPI loop */
+	if (!busy_poll_budget &&
+	    (!xsk->need_wakeup || !xsk_ring_prod__needs_wakeup(&xsk->umem.fq)))
+		return;
+
+	if (recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT,
+		     NULL, NULL) >= 0)
+		return;
+
+	if (errno == EAGAIN || errno == EBUSY || errno == ENOBUFS ||
+	    errno == ENETDOWN)
+		return;
+
+	kick_fail(xsk, "fill ring wakeup", errno);
+}
+
+bool xsk_tx(const void *pkt, size_t length)
+{
+	struct xsk_socket_info *xsk = xsk_current;
+	uint32_t idx_tx;
+	uint64_t addr;
+
+	if (!xsk)
+		return false;
+
+	if (length > FRAME_SIZE)
+		return false;
+
+	/* Rewritten in place (the emulator grew it within the frame),
+	 * so the frame itself goes back out.
+	 */
+	uint64_t frame = ((const char *)pkt - (char *)xsk->umem.buffer) / FRAME_SIZE;
+	bool in_place = pkt >= xsk->umem.buffer &&
+		frame < NUM_FRAMES && xsk->rx_held[frame] &&
+		(const char *)pkt + length <=
+			(char *)xsk->umem.buffer + (frame + 1) * FRAME_SIZE;
+
+	if (!in_place && !xsk->frames_free)
+		tx_complete(xsk);
+	if (!in_place && !xsk->frames_free) {
+		tx_flush(xsk);
+		/* Still nothing, the NIC is backed up. Drop it, like a
+		 * full qdisc would.
+		 */
+		if (!xsk->frames_free)
+			return true;
+	}
+
+	if (xsk_ring_prod__reserve(&xsk->tx, 1, &idx_tx) != 1) {
+		tx_flush(xsk);
+		if (xsk_ring_prod__reserve(&xsk->tx, 1, &idx_tx) != 1)
+			return true;
+	}
+
+	if (in_place) {
+		addr = pkt - xsk->umem.buffer;
+		xsk->rx_held[frame] = false;
+	} else {
+		addr = xsk->frames[--xsk->frames_free];
+		memcpy(xsk_umem__get_data(xsk->umem.buffer, addr), pkt, length);
+	}
+
+	struct xdp_desc *desc = xsk_ring_prod__tx_desc(&xsk->tx, idx_tx);
+	desc->addr = addr;
+	desc->len = length;
+
+	xsk->tx_pending++;
+
+	return true;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		crash_with_perror("clock_gettime");
+
+	return (uint64_t) now.tv_sec * SECOND_NS + now.tv_nsec;
+}
+
+static void record_latency(struct xsk_socket_info *xsk, const void *pkt,
+			   uint64_t now)
+{
+	const struct xsk_rx_meta *meta = pkt - sizeof(*meta);
+
+	if (meta->magic != XSK_RX_META_MAGIC || meta->ktime_ns > now)
+		return;
+
+	uint64_t delta = now - meta->ktime_ns;
+	int bucket = delta ? 64 - __builtin_clzll(delta) : 0;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	xsk->latency_hist[bucket]++;
+}
+
+static void fq_refill(struct xsk_socket_info *xsk)
+{
+	uint32_t idx_fq = 0;
+	uint32_t want = NUM_RX_FRAMES - xsk->fq_outstanding;
+
+	if (want > xsk->frames_free)
+		want = xsk->frames_free;
+	if (!want)
+		return;
+
+	want = xsk_ring_prod__reserve(&xsk->umem.fq, want, &idx_fq);
+	for (uint32_t i = 0; i < want; i++)
+		*xsk_ring_prod__fill_addr(&xsk->umem.fq, idx_fq++) =
+			xsk->frames[--xsk->frames_free];
+
+	xsk_ring_prod__submit(&xsk->umem.fq, want);
+	xsk->fq_outstanding += want;
+}
+
+static unsigned int rx_batch(struct xsk_socket_info *xsk)
+{
+	unsigned int rcvd, i;
+	uint32_t idx_rx = 0;
+	uint64_t now = 0;
+
+	rcvd = xsk_ring_cons__peek(&xsk->rx, RX_BATCH_SIZE, &idx_rx);
+	if (!rcvd) {
+		tx_complete(xsk);
+		fq_refill(xsk);
+		fq_kick(xsk);
+		return 0;
+	}
+
+	if (xsk_latency_stats)
+		now = monotonic_ns();
+
+	struct pkt_buf bufs[RX_BATCH_SIZE];
+	uint64_t origs[RX_BATCH_SIZE];
 
 	for (i = 0; i < rcvd; i++) {
 		uint64_t addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
 		uint32_t len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
-		uint64_t orig = xsk_umem__extract_addr(addr);
+		uint64_t orig = xsk_umem__extract_addr(addr) &
+				~(uint64_t)(FRAME_SIZE - 1);
 
 		addr = xsk_umem__add_offset_to_addr(addr);
 		char *pkt = xsk_umem__get_data(xsk->umem.buffer, addr);
-		xsk->handler(pkt, len);
+		if (xsk_latency_stats)
+			record_latency(xsk, pkt, now);
+
+		char *frame = xsk_umem__get_data(xsk->umem.buffer, orig);
+
+		origs[i] = orig;
+		xsk->rx_held[orig / FRAME_SIZE] = true;
+
+		bufs[i] = (struct pkt_buf) {
+			.data = pkt,
+			.data_end = pkt + len,
+			.data_hard_start = frame,
+			.data_hard_end = frame + FRAME_SIZE,
+		};
+	}
+
+	xsk_current = xsk;
+	xsk->handler(bufs, rcvd);
+	xsk_current = NULL;
 
-		*xsk_ring_prod__fill_addr(&xsk->umem.fq, idx_fq++) = orig;
+	for (i = 0; i < rcvd; i++) {
+		if (!xsk->rx_held[origs[i] / FRAME_SIZE])
+			continue;
+
+		xsk->rx_held[origs[i] / FRAME_SIZE] = false;
+		xsk->frames[xsk->frames_free++] = origs[i];
 	}
 
-	xsk_ring_prod__submit(&xsk->umem.fq, rcvd);
 	xsk_ring_cons__release(&xsk->rx, rcvd);
+	xsk->fq_outstanding -= rcvd;
+
+	tx_flush(xsk);
+	fq_refill(xsk);
+	fq_kick(xsk);
+
+	return rcvd;
+}
+
+static void rx_cb(int fd, void *ctx, bool expired)
+{
+	struct xsk_socket_info *xsk = ctx;
+
+	assert(xsk_socket__fd(xsk->xsk) == fd);
+
+	rx_batch(xsk);
 }
 
-static struct eventloop *xsk_rx_el;
-static int xsk_rx_rpc;
+static void rx_thread_fn(void *arg)
+{
+	struct xsk_socket_info *xsk = arg;
+
+	if (!busy_poll_budget) {
+		eventloop_thread_fn(xsk->el);
+		return;
+	}
+
+	/* Spin on the rings while there is traffic. Once the queue has
+	 * been idle for a while, sleep in poll() until the next packet
+	 * wakes us, instead of burning the CPU for nothing.
+	 */
+	eventloop_install_break(xsk->el, thread_stop_eventfd(current));
+	eventloop_install_event_sync(xsk->el, &(struct event){
+		.fd = xsk_socket__fd(xsk->xsk),
+		.handler_type = EVT_BREAK,
+	});
+
+	while (!thread_should_stop(current)) {
+		uint64_t last_rx = monotonic_ns();
+
+		while (!thread_should_stop(current)) {
+			if (rx_batch(xsk))
+				last_rx = monotonic_ns();
+			else if (monotonic_ns() - last_rx > BUSY_POLL_IDLE_NS)
+				break;
+		}
+
+		if (thread_should_stop(current))
+			break;
+
+		eventloop_enter(xsk->el, -1);
+	}
+}
+
+static void set_busy_poll(struct xsk_socket_info *xsk)
+{
+	int fd = xsk_socket__fd(xsk->xsk);
+	int opt;
+
+	opt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt)))
+		goto err;
+
+	opt = busy_poll_usecs;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)))
+		goto err;
+
+	opt = busy_poll_budget;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt, sizeof(opt)))
+		goto err;
+
+	return;
+
+err:
+	log_printf("AF_XDP queue %d: busy poll unavailable: %s\n",
+		   xsk->queue, strerror(errno));
+}
+
+/* With SO_PREFER_BUSY_POLL, the kernel only keeps the device IRQ masked
+ * while we poll if NAPI is allowed to defer it. Best effort; the values are
+ * the ones suggested in Documentation/networking/napi.rst. These are device
+ * wide, so whatever was there before is put back on exit.
+ */
+static struct {
+	const char *file;
+	const char *value;
+	char path[PATH_MAX];
+	char saved[32];
+	bool changed;
+} napi_knobs[] = {
+	{ .file = "napi_defer_hard_irqs", .value = "2" },
+	{ .file = "gro_flush_timeout", .value = "200000" },
+};
+
+static bool write_sysfs(const char *path, const char *value)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return false;
+
+	fputs(value, f);
+	if (fclose(f))
+		return false;
+
+	return true;
+}
+
+static void restore_napi_defer(void)
+{
+	for (int i = 0; i < ARRAY_SIZE(napi_knobs); i++) {
+		if (!napi_knobs[i].changed)
+			continue;
+
+		if (!write_sysfs(napi_knobs[i].path, napi_knobs[i].saved))
+			log_printf("Failed to restore %s: %s\n",
+				   napi_knobs[i].path, strerror(errno));
+	}
+}
+
+static void set_napi_defer(const char *iface)
+{
+	for (int i = 0; i < ARRAY_SIZE(napi_knobs); i++) {
+		char *path = napi_knobs[i].path;
+		char *saved = napi_knobs[i].saved;
+
+		snprintf(path, PATH_MAX, "/sys/class/net/%s/%s", iface,
+			 napi_knobs[i].file);
+
+		FILE *f = fopen(path, "r");
+		if (!f)
+			goto err;
+
+		if (!fgets(saved, sizeof(napi_knobs[i].saved), f)) {
+			fclose(f);
+			errno = EIO;
+			goto err;
+		}
+		fclose(f);
+
+		if (!write_sysfs(path, napi_knobs[i].value))
+			goto err;
+
+		napi_knobs[i].changed = true;
+		continue;
+
+err:
+		log_printf("Failed to set %s: %s\n", path, strerror(errno));
+	}
+
+	atexit(restore_napi_defer);
+}
+
+static void latency_log_cb(int fd, void *ctx, bool expired)
+{
+	static uint64_t last_hist[LATENCY_BUCKETS];
+	uint64_t hist[LATENCY_BUCKETS] = {0};
+	uint64_t total = 0;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		crash_with_perror("read(timerfd)");
+
+	pthread_mutex_lock(&xsks_lock);
+	for (int i = 0; i < darray_nmemb(xsks); i++)
+		for (int j = 0; j < LATENCY_BUCKETS; j++)
+			hist[j] += CMM_LOAD_SHARED((*darray_idx(xsks, i))->latency_hist[j]);
+	pthread_mutex_unlock(&xsks_lock);
+
+	for (int j = 0; j < LATENCY_BUCKETS; j++) {
+		uint64_t cur = hist[j];
+
+		hist[j] -= last_hist[j];
+		last_hist[j] = cur;
+		total += hist[j];
+	}
+
+	if (!total)
+		return;
+
+	/* Report the upper bound of the bucket each percentile lands in */
+	static const int permille[] = { 500, 900, 990, 999, 1000 };
+	uint64_t bound_us[ARRAY_SIZE(permille)];
+	uint64_t seen = 0;
+	int p = 0;
+
+	for (int j = 0; j < LATENCY_BUCKETS && p < ARRAY_SIZE(permille); j++) {
+		seen += hist[j];
+		while (p < ARRAY_SIZE(permille) &&
+		       seen * 1000 >= total * permille[p])
+			bound_us[p++] = ((1ULL << j) + 999) / 1000;
+	}
+
+	log_printf("AF_XDP latency over %" PRIu64 " pkts (us): "
+		   "p50<=%" PRIu64 " p90<=%" PRIu64 " p99<=%" PRIu64
+		   " p99.9<=%" PRIu64 " max<=%" PRIu64 "\n",
+		   total, bound_us[0], bound_us[1], bound_us[2],
+		   bound_us[3], bound_us[4]);
+}
+
+static void latency_log_init(void)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		crash_with_perror("timerfd_create");
+
+	struct itimerspec its = {
+		.it_interval = { .tv_sec = LATENCY_LOG_INTERVAL_S },
+		.it_value = { .tv_sec = LATENCY_LOG_INTERVAL_S },
+	};
+	if (timerfd_settime(fd, 0, &its, NULL))
+		crash_with_perror("timerfd_settime");
+
+	worker_install_event(&(struct event){
+		.fd = fd,
+		.eventfd_ack = false,
+		.handler_type = EVT_CALL_FN,
+		.handler_fn = latency_log_cb,
+	});
+}
+
+/* Find the CPU servicing the RX interrupt of a queue. Drivers name their
+ * per-queue vectors after either the interface (eth0-TxRx-0, eth0-rx-0) or
+ * the underlying device (virtio0-input.0), so match on either of them and
+ * the trailing queue number. If nothing matches, spread queues round-robin.
+ */
+static int queue_irq_cpu(const char *iface, int queue)
+{
+	char path[PATH_MAX];
+	char devname[PATH_MAX] = "";
+	int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	int irq = -1;
+	int cpu = -1;
+
+	if (ncpus <= 0)
+		ncpus = 1;
+
+	snprintf(path, PATH_MAX, "/sys/class/net/%s/device", iface);
+	char *link = realpath(path, NULL);
+	if (link) {
+		snprintf(devname, PATH_MAX, "%s", strrchr(link, '/') + 1);
+		free(link);
+	}
+
+	char *buf = read_whole_file("/proc/interrupts", NULL);
+
+	char *saveptr;
+	char *line = strtok_r(buf, "\n", &saveptr);
+	while (irq < 0 && (line = strtok_r(NULL, "\n", &saveptr))) {
+		int line_irq;
+		if (sscanf(line, " %d:", &line_irq) != 1)
+			continue;
+
+		char *name = strrchr(line, ' ');
+		if (!name)
+			continue;
+		name++;
+
+		if (!strstr(name, iface) &&
+		    !(*devname && strstr(name, devname)))
+			continue;
+		if (strcasestr(name, "output") || strcasestr(name, "-tx-"))
+			continue;
+
+		char *end = name + strlen(name);
+		char *num = end;
+		while (num > name && num[-1] >= '0' && num[-1] <= '9')
+			num--;
+		if (num == end || num == name)
+			continue;
+		if (num[-1] != '-' && num[-1] != '.' && num[-1] != '_')
+			continue;
+
+		if (atoi(num) == queue)
+			irq = line_irq;
+	}
+
+	free(buf);
+
+	if (irq >= 0) {
+		snprintf(path, PATH_MAX, "/proc/irq/%d/effective_affinity_list", irq);
+		if (access(path, R_OK))
+			snprintf(path, PATH_MAX, "/proc/irq/%d/smp_affinity_list", irq);
+
+		if (!access(path, R_OK)) {
+			buf = read_whole_file(path, NULL);
+			if (sscanf(buf, "%d", &cpu) != 1)
+				cpu = -1;
+			free(buf);
+		}
+	}
+
+	if (cpu < 0 || cpu >= ncpus)
+		cpu = queue % ncpus;
+
+	return cpu;
+}
+
+#define UMEM_SIZE (NUM_FRAMES * FRAME_SIZE)
+
+static void configure_umem(struct xsk_socket_info *xsk)
+{
+	struct xsk_umem_config umem_cfg = {
+		.fill_size = NUM_RX_FRAMES * 2,
+		.comp_size = NUM_FRAMES,
+		.frame_size = FRAME_SIZE,
+		.frame_headroom = FRAME_HEADROOM,
+	};
+	if (xsk_umem__create(&xsk->umem.umem, xsk->umem.buffer, UMEM_SIZE,
+	    &xsk->umem.fq, &xsk->umem.cq, &umem_cfg))
+		crash_with_perror("xsk_umem__create");
+
+	xsk->frames_free = 0;
+	xsk->fq_outstanding = 0;
+	for (int i = NUM_FRAMES - 1; i >= 0; i--)
+		xsk->frames[xsk->frames_free++] = i * FRAME_SIZE;
+
+	fq_refill(xsk);
+	if (xsk->fq_outstanding != NUM_RX_FRAMES)
+		crash_with_perror("xsk_ring_prod__reserve");
+}
 
 struct xsk_socket *xsk_configure_socket(const char *iface, int queue,
-	void (*handler)(void *pkt, size_t length))
+	void (*handler)(struct pkt_buf *bufs, unsigned int n))
 {
 	static atomic_flag init_done = ATOMIC_FLAG_INIT;
 	if (!atomic_flag_test_and_set(&init_done)) {
@@ -135,68 +725,94 @@ struct xsk_socket *xsk_configure_socket(const char *iface, int queue,
 
 		atexit(del_socket);
 
-		int xsk_rx_rpc_recv;
-		make_fd_pair(&xsk_rx_rpc, &xsk_rx_rpc_recv);
-
-		xsk_rx_el = eventloop_new();
-		eventloop_install_rpc(xsk_rx_el, xsk_rx_rpc_recv);
-		thread_start(eventloop_thread_fn, xsk_rx_el, "xsk_rx");
+		if (busy_poll_budget)
+			set_napi_defer(iface);
+		if (xsk_latency_stats)
+			latency_log_init();
 	}
 
 	struct xsk_socket_info *xsk = calloc(1, sizeof(*xsk));
-
-	size_t bufs_size = NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE;
+	if (!xsk)
+		crash_with_perror("calloc");
 
 	xsk->handler = handler;
 
-	xsk->umem.buffer = mmap(NULL, bufs_size,
+	xsk->umem.buffer = mmap(NULL, UMEM_SIZE,
 				PROT_READ | PROT_WRITE,
 				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (xsk->umem.buffer == MAP_FAILED)
 		crash_with_perror("mmap");
 
-	struct xsk_umem_config umem_cfg = {
-		.fill_size = NUM_FRAMES * 2,
-		.comp_size = NUM_FRAMES * 2,
-		.frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+	static const struct {
+		enum xsk_mode mode;
+		uint16_t bind_flags;
+	} attempts[] = {
+		{ XSK_MODE_ZEROCOPY, XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP },
+		{ XSK_MODE_COPY, XDP_COPY | XDP_USE_NEED_WAKEUP },
+		/* Pre-5.4 kernels do not know about need_wakeup */
+		{ XSK_MODE_COPY, XDP_COPY },
 	};
-	if (xsk_umem__create(&xsk->umem.umem, xsk->umem.buffer, bufs_size,
-	    &xsk->umem.fq, &xsk->umem.cq, &umem_cfg))
-		crash_with_perror("xsk_umem__create");
 
-	uint32_t idx;
+	for (int i = 0; i < ARRAY_SIZE(attempts); i++) {
+		if (xsk_mode != XSK_MODE_AUTO && xsk_mode != attempts[i].mode)
+			continue;
+
+		configure_umem(xsk);
+
+		struct xsk_socket_config xsk_cfg = {
+			.rx_size = NUM_RX_FRAMES,
+			.tx_size = NUM_TX_FRAMES,
+			.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
+			.bind_flags = attempts[i].bind_flags,
+		};
+		if (!xsk_socket__create(&xsk->xsk, iface, queue, xsk->umem.umem,
+					&xsk->rx, &xsk->tx, &xsk_cfg)) {
+			xsk->zerocopy = attempts[i].bind_flags & XDP_ZEROCOPY;
+			xsk->need_wakeup = attempts[i].bind_flags & XDP_USE_NEED_WAKEUP;
+			break;
+		}
 
-	if (xsk_ring_prod__reserve(&xsk->umem.fq,
-				   NUM_FRAMES, &idx) != NUM_FRAMES)
-		crash_with_perror("xsk_ring_prod__reserve");
-	for (int i = 0; i < NUM_FRAMES; i++)
-		*xsk_ring_prod__fill_addr(&xsk->umem.fq, idx++) =
-			i * XSK_UMEM__DEFAULT_FRAME_SIZE;
-	xsk_ring_prod__submit(&xsk->umem.fq, NUM_FRAMES);
-
-	struct xsk_socket_config xsk_cfg = {
-		.rx_size = NUM_FRAMES,
-		.tx_size = NUM_FRAMES,
-		.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
-	};
-	if (xsk_socket__create(&xsk->xsk, iface, queue, xsk->umem.umem,
-			       &xsk->rx, NULL, &xsk_cfg)) {
 		xsk_umem__delete(xsk->umem.umem);
+		xsk->umem.umem = NULL;
+	}
+
+	if (!xsk->xsk) {
+		munmap(xsk->umem.buffer, UMEM_SIZE);
 		free(xsk);
 		return NULL;
 	}
 
+	log_printf("AF_XDP queue %d bound in %s mode%s\n", queue,
+		   xsk->zerocopy ? "zero-copy" : "copy",
+		   xsk->need_wakeup ? " with need_wakeup" : "");
+
 	pthread_mutex_lock(&xsks_lock);
 	darray_inc(xsks);
 	*darray_tail(xsks) = xsk;
 	pthread_mutex_unlock(&xsks_lock);
 
-	eventloop_install_event_async(xsk_rx_el, &(struct event){
+	xsk->queue = queue;
+	xsk->cpu = queue_irq_cpu(iface, queue);
+
+	if (busy_poll_budget)
+		set_busy_poll(xsk);
+
+	/* Nothing runs on the eventloop yet, so no need for RPC */
+	xsk->el = eventloop_new();
+	eventloop_install_event_sync(xsk->el, &(struct event){
 		.fd = xsk_socket__fd(xsk->xsk),
 		.handler_type = EVT_CALL_FN,
 		.handler_fn = rx_cb,
 		.handler_ctx = xsk,
-	}, xsk_rx_rpc);
+	});
+
+	char name[16];
+	snprintf(name, sizeof(name), "xsk_rx/%d", queue);
+	xsk->thread = thread_start(rx_thread_fn, xsk, name);
+
+	if (thread_set_cpu(xsk->thread, xsk->cpu))
+		log_printf("AF_XDP queue %d: failed to pin to CPU %d\n",
+			   queue, xsk->cpu);
 
 	return xsk->xsk;
 }